@@ -0,0 +1,244 @@
+// nufs-bench: times the storage layer directly, without FUSE
+//
+//   nufs-bench [-b <page size>] [-p <pages>] [-n <files>] [-s <io size>]
+//              [-m <MB per test>] [<image>]
+//
+// Makes a fresh image, in a temporary file that is removed afterwards
+// unless one is named, and reports the cost of each operation:
+//   create, lookup, stat, unlink   of -n files in one directory
+//   seq/rand write and read        of -s byte calls on files of each size
+//                                  up to the largest a file can be
+// Every data test moves about -m MB so the small sizes aren't all noise.
+// The output is one line per test: name, ops, ns/op and MB/s.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+
+static long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void
+report(const char* name, long ops, long ns, long bytes)
+{
+    printf("%-16s %10ld ops %10.0f ns/op", name, ops, (double)ns / ops);
+    if (bytes > 0) {
+        printf(" %10.1f MB/s", bytes / 1048576.0 / (ns / 1e9));
+    }
+    printf("\n");
+}
+
+static void
+check(int ok, const char* what)
+{
+    if (!ok) {
+        fprintf(stderr, "nufs-bench: %s failed\n", what);
+        exit(1);
+    }
+}
+
+static void
+bench_meta(int count)
+{
+    char path[64];
+    struct stat st;
+    check(storage_mknod("/meta", 040755) == 0, "mkdir");
+
+    long start = now_ns();
+    for (int ii = 0; ii < count; ++ii) {
+        sprintf(path, "/meta/file%d", ii);
+        check(storage_mknod(path, 0100644) == 0, "create");
+    }
+    report("create", count, now_ns() - start, 0);
+
+    start = now_ns();
+    for (int ii = 0; ii < count; ++ii) {
+        sprintf(path, "/meta/file%d", ii);
+        check(tree_lookup(path) > 0, "lookup");
+    }
+    report("lookup", count, now_ns() - start, 0);
+
+    start = now_ns();
+    for (int ii = 0; ii < count; ++ii) {
+        sprintf(path, "/meta/file%d", ii);
+        check(storage_stat(path, &st) == 0, "stat");
+    }
+    report("stat", count, now_ns() - start, 0);
+
+    start = now_ns();
+    for (int ii = 0; ii < count; ++ii) {
+        sprintf(path, "/meta/missing%d", ii);
+        check(storage_stat(path, &st) < 0, "stat");
+    }
+    report("stat missing", count, now_ns() - start, 0);
+
+    start = now_ns();
+    for (int ii = 0; ii < count; ++ii) {
+        sprintf(path, "/meta/file%d", ii);
+        check(storage_unlink(path) == 0, "unlink");
+    }
+    report("unlink", count, now_ns() - start, 0);
+}
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t
+next_rand()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// one file of size bytes, written and read in io byte calls
+static void
+bench_data(long size, int io, long total)
+{
+    char* buf = malloc(io);
+    memset(buf, 'x', io);
+    char path[64];
+    char name[64];
+    sprintf(path, "/data%ld", size);
+    check(storage_mknod(path, 0100644) == 0, "create");
+
+    long calls = size / io;
+    long rounds = total / size > 0 ? total / size : 1;
+
+    long start = now_ns();
+    for (long rr = 0; rr < rounds; ++rr) {
+        for (long cc = 0; cc < calls; ++cc) {
+            check(storage_write(path, buf, io, cc * io) == io, "write");
+        }
+    }
+    sprintf(name, "seq write %ldk", size / 1024);
+    report(name, rounds * calls, now_ns() - start, rounds * calls * io);
+
+    start = now_ns();
+    for (long rr = 0; rr < rounds; ++rr) {
+        for (long cc = 0; cc < calls; ++cc) {
+            check(storage_read(path, buf, io, cc * io) == io, "read");
+        }
+    }
+    sprintf(name, "seq read %ldk", size / 1024);
+    report(name, rounds * calls, now_ns() - start, rounds * calls * io);
+
+    start = now_ns();
+    for (long ii = 0; ii < rounds * calls; ++ii) {
+        long off = next_rand() % calls * io;
+        check(storage_write(path, buf, io, off) == io, "write");
+    }
+    sprintf(name, "rand write %ldk", size / 1024);
+    report(name, rounds * calls, now_ns() - start, rounds * calls * io);
+
+    start = now_ns();
+    for (long ii = 0; ii < rounds * calls; ++ii) {
+        long off = next_rand() % calls * io;
+        check(storage_read(path, buf, io, off) == io, "read");
+    }
+    sprintf(name, "rand read %ldk", size / 1024);
+    report(name, rounds * calls, now_ns() - start, rounds * calls * io);
+
+    check(storage_unlink(path) == 0, "unlink");
+    free(buf);
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufs-bench [-b <page size>] [-p <pages>] [-n <files>] "
+                    "[-s <io size>] [-m <MB per test>] [<image>]\n");
+    exit(2);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int page_size = 4096;
+    int page_count = 65536;
+    int files = 10000;
+    int io = 4096;
+    long total = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:n:s:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            page_size = atoi(optarg);
+            break;
+        case 'p':
+            page_count = atoi(optarg);
+            break;
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 's':
+            io = atoi(optarg);
+            break;
+        case 'm':
+            total = atol(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc - 1 || files < 1 || io < 1 || total < 1) {
+        usage();
+    }
+
+    char path[PATH_MAX] = "/tmp/nufs-bench.XXXXXX";
+    int named = optind < argc;
+    if (named) {
+        snprintf(path, sizeof(path), "%s", argv[optind]);
+    }
+    else {
+        int fd = mkstemp(path);
+        check(fd >= 0, "mkstemp");
+        close(fd);
+    }
+    page_count = (page_count + 7) / 8 * 8;
+    int inodes = (files + 64 + 7) / 8 * 8;
+    inodes = inodes > page_count ? inodes : page_count;
+    if (pages_format(path, page_size, page_count, inodes, 0) < 0) {
+        fprintf(stderr, "nufs-bench: %s: can't make an image of that size\n", path);
+        return 1;
+    }
+    if (storage_init(path) < 0) {
+        fprintf(stderr, "nufs-bench: can't open %s\n", path);
+        return 1;
+    }
+    printf("# %d pages of %d bytes, %d files, %d byte calls\n",
+           PAGE_COUNT, PAGE_BYTES, files, io);
+
+    bench_meta(files);
+
+    // the largest file is what the direct pointers and one indirect page
+    // reach, and has to fit the image next to the metadata
+    long biggest = (long)(nptrs + PAGE_BYTES / sizeof(int)) * PAGE_BYTES;
+    long room = (long)(PAGE_COUNT - META_PAGES - 8) * PAGE_BYTES;
+    biggest = biggest < room ? biggest : room;
+    for (long size = 4096; size <= biggest; size *= 4) {
+        if (size >= io) {
+            bench_data(size, io, total << 20);
+        }
+    }
+
+    storage_close();
+    if (!named) {
+        unlink(path);
+    }
+    return 0;
+}
@@ -12,7 +12,6 @@ int bitmap_get(void* bm, int ii) {
 
 // puts a value at the specified bit in the bitmap
 void bitmap_put(void* bm, int ii, int vv) {
-    bitmap_print(bm, ii);
     int bit = (vv) ? 1 : 0;
     char* bitmap = (char*)bm;
     if (bitmap_get(bm, ii) == bit) {
@@ -21,7 +20,6 @@ void bitmap_put(void* bm, int ii, int vv) {
     else {
         bitmap[(ii / 8)] ^= 1 << ii % 8; 
     }
-    bitmap_print(bm, ii);
 }
 
 // debug statement
@@ -0,0 +1,375 @@
+// Implementation of compress.h
+//
+// Files flagged INODE_COMPRESS have their data compressed a cluster of
+// ZCLUSTER pages at a time when they are closed. A cluster that shrinks to
+// fewer pages is stored in those pages (header first, then the compressed
+// bytes), and every page pointer of the cluster carries PTR_Z: the first
+// ones point at the stored pages, the rest are just PTR_Z. Reads go
+// through a small cache of decompressed clusters. Writing into a
+// compressed cluster, or cutting one with a truncate, expands it back into
+// plain pages first; the next close compresses it again.
+//
+// The codec is a small LZ77 in the style of LZ4: each sequence is a token
+// (4 bits literal count, 4 bits match length - 4), the literals, then a
+// 2 byte offset back into the output. The last sequence is literals only.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+#include "inode.h"
+#include "pages.h"
+#include "util.h"
+#include "log.h"
+
+#define LZ_MIN 4 // shortest match
+#define LZ_TAIL 8 // the last bytes always go out as literals
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xffff // offsets are 2 bytes
+
+#define ZCACHE_SIZE 8
+
+typedef struct zhdr {
+    uint32_t clen;   // compressed bytes following the header
+    uint32_t _reserved;
+    uint64_t serial; // tells apart clusters that reuse the same page
+} zhdr;
+
+typedef struct zcache_entry {
+    int      pnum;   // first stored page of the cluster, 0 if unused
+    uint64_t serial;
+    long     used;   // last use, for evicting the oldest
+    char     data[ZCLUSTER * MAX_PAGE_BYTES];
+} zcache_entry;
+
+static zcache_entry zcache[ZCACHE_SIZE];
+static long zcache_clock = 0;
+static uint64_t zserial = 0;
+
+// writes the extra length bytes for a length that didn't fit its nibble
+static int
+lz_put_len(char* dst, int op, int cap, int len)
+{
+    while (len >= 255) {
+        if (op >= cap) {
+            return -1;
+        }
+        dst[op++] = (char)255;
+        len -= 255;
+    }
+    if (op >= cap) {
+        return -1;
+    }
+    dst[op++] = len;
+    return op;
+}
+
+// writes one sequence, a match length of 0 marks the last one
+static int
+lz_put_seq(char* dst, int op, int cap, const char* lit, int nlit, int offset, int mlen)
+{
+    if (op >= cap) {
+        return -1;
+    }
+    int mcode = mlen ? mlen - LZ_MIN : 0;
+    dst[op++] = (min(nlit, 15) << 4) | min(mcode, 15);
+    if (nlit >= 15 && (op = lz_put_len(dst, op, cap, nlit - 15)) < 0) {
+        return -1;
+    }
+    if (op + nlit > cap) {
+        return -1;
+    }
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return op;
+    }
+
+    if (op + 2 > cap) {
+        return -1;
+    }
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    if (mcode >= 15 && (op = lz_put_len(dst, op, cap, mcode - 15)) < 0) {
+        return -1;
+    }
+    return op;
+}
+
+// compresses len bytes of src into dst, returns the compressed length or
+// -1 if it doesn't fit in cap bytes
+int
+lz_compress(const char* src, int len, char* dst, int cap)
+{
+    const uint8_t* in = (const uint8_t*)src;
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN + LZ_TAIL <= len) {
+        uint32_t seq;
+        uint32_t prev;
+        memcpy(&seq, in + ip, 4);
+        int hh = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hh];
+        table[hh] = ip;
+        memcpy(&prev, in + ref, 4);
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || prev != seq) {
+            ++ip;
+            continue;
+        }
+
+        int mlen = LZ_MIN;
+        while (ip + mlen + LZ_TAIL < len && in[ref + mlen] == in[ip + mlen]) {
+            ++mlen;
+        }
+        op = lz_put_seq(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+        if (op < 0) {
+            return -1;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    return lz_put_seq(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+static int
+lz_get_len(const uint8_t* in, int* ip, int len, int base)
+{
+    int bb;
+    do {
+        if (*ip >= len) {
+            return -1;
+        }
+        bb = in[(*ip)++];
+        base += bb;
+    } while (bb == 255);
+    return base;
+}
+
+// decompresses len bytes of src into dst, returns the decompressed length
+// or -1 if the input is damaged
+int
+lz_decompress(const char* src, int len, char* dst, int cap)
+{
+    const uint8_t* in = (const uint8_t*)src;
+    int ip = 0;
+    int op = 0;
+    while (ip < len) {
+        int token = in[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15 && (nlit = lz_get_len(in, &ip, len, nlit)) < 0) {
+            return -1;
+        }
+        if (ip + nlit > len || op + nlit > cap) {
+            return -1;
+        }
+        memcpy(dst + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == len) {
+            break;
+        }
+
+        if (ip + 2 > len) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && (mlen = lz_get_len(in, &ip, len, mlen)) < 0) {
+            return -1;
+        }
+        mlen += LZ_MIN;
+        if (offset == 0 || offset > op || op + mlen > cap) {
+            return -1;
+        }
+        // byte by byte, the match may overlap what it produces
+        for (int ii = 0; ii < mlen; ++ii) {
+            dst[op] = dst[op - offset];
+            ++op;
+        }
+    }
+    return op;
+}
+
+// swaps the pages of a cluster for new pointers and drops the old pages
+static int
+compress_swap(inode* node, int first, int* ptrs)
+{
+    int old[ZCLUSTER];
+    for (int ii = 0; ii < ZCLUSTER; ++ii) {
+        old[ii] = ptr_pnum(inode_get_ptr(node, first + ii));
+    }
+    for (int ii = 0; ii < ZCLUSTER; ++ii) {
+        if (inode_set_ptr(node, first + ii, ptrs[ii]) < 0) {
+            return -1;
+        }
+    }
+    for (int ii = 0; ii < ZCLUSTER; ++ii) {
+        free_page(old[ii]);
+    }
+    return 0;
+}
+
+// compresses every whole cluster of the file that isn't yet, returns the
+// number of pages saved
+int
+compress_inode(inode* node)
+{
+    static char plain[ZCLUSTER * MAX_PAGE_BYTES];
+    static char packed[(ZCLUSTER - 1) * MAX_PAGE_BYTES];
+    if (zserial == 0) {
+        zserial = (uint64_t)time(NULL) << 20;
+    }
+
+    int saved = 0;
+    for (int first = 0; first + ZCLUSTER <= node->size / PAGE_BYTES; first += ZCLUSTER) {
+        if (inode_get_ptr(node, first) & PTR_Z) {
+            continue;
+        }
+        // a cluster with a hole in it is left sparse
+        int hole = 0;
+        for (int ii = 0; ii < ZCLUSTER; ++ii) {
+            int pnum = inode_get_ptr(node, first + ii);
+            if (pnum == 0) {
+                hole = 1;
+                break;
+            }
+            memcpy(plain + ii * PAGE_BYTES, pages_get_page(pnum), PAGE_BYTES);
+        }
+        if (hole) {
+            continue;
+        }
+
+        // only worth it if we save at least a page
+        zhdr* hdr = (zhdr*)packed;
+        int clen = lz_compress(plain, ZCLUSTER * PAGE_BYTES, packed + sizeof(zhdr),
+                               (ZCLUSTER - 1) * PAGE_BYTES - sizeof(zhdr));
+        if (clen < 0) {
+            continue;
+        }
+        hdr->clen = clen;
+        hdr->_reserved = 0;
+        hdr->serial = ++zserial;
+        int nstored = bytes_to_pages(sizeof(zhdr) + clen);
+
+        int ptrs[ZCLUSTER];
+        for (int ii = 0; ii < ZCLUSTER; ++ii) {
+            ptrs[ii] = PTR_Z;
+        }
+        for (int ii = 0; ii < nstored; ++ii) {
+            int pnum = alloc_page();
+            if (pnum < 0) {
+                for (int jj = 0; jj < ii; ++jj) {
+                    free_page(ptr_pnum(ptrs[jj]));
+                }
+                return saved;
+            }
+            memcpy(pages_get_page(pnum), packed + ii * PAGE_BYTES, PAGE_BYTES);
+            page_written(pnum);
+            ptrs[ii] = pnum | PTR_Z;
+        }
+        if (compress_swap(node, first, ptrs) < 0) {
+            return saved;
+        }
+        saved += ZCLUSTER - nstored;
+    }
+    log_debug("+ compress_inode() -> %d pages saved\n", saved);
+    return saved;
+}
+
+// gets the decompressed cluster starting at page first, through the cache
+static char*
+compress_load(inode* node, int first)
+{
+    static char packed[(ZCLUSTER - 1) * MAX_PAGE_BYTES];
+    int pnum = ptr_pnum(inode_get_ptr(node, first));
+    zhdr* hdr = pages_get_page(pnum);
+
+    zcache_entry* victim = &zcache[0];
+    for (int ii = 0; ii < ZCACHE_SIZE; ++ii) {
+        zcache_entry* entry = &zcache[ii];
+        if (entry->pnum == pnum && entry->serial == hdr->serial) {
+            entry->used = ++zcache_clock;
+            return entry->data;
+        }
+        if (entry->used < victim->used) {
+            victim = entry;
+        }
+    }
+
+    int nstored = bytes_to_pages(sizeof(zhdr) + hdr->clen);
+    if (nstored >= ZCLUSTER) {
+        return NULL;
+    }
+    for (int ii = 0; ii < nstored; ++ii) {
+        int stored = ptr_pnum(inode_get_ptr(node, first + ii));
+        if (page_verify(stored) < 0) {
+            return NULL;
+        }
+        memcpy(packed + ii * PAGE_BYTES, pages_get_page(stored), PAGE_BYTES);
+    }
+    victim->pnum = 0;
+    int len = lz_decompress(packed + sizeof(zhdr), hdr->clen,
+                            victim->data, ZCLUSTER * PAGE_BYTES);
+    if (len != ZCLUSTER * PAGE_BYTES) {
+        log_error("nufs: compress_load(%d): damaged cluster\n", pnum);
+        return NULL;
+    }
+    victim->pnum = pnum;
+    victim->serial = hdr->serial;
+    victim->used = ++zcache_clock;
+    return victim->data;
+}
+
+// empties the cache, the next image can have clusters at the same pages
+void
+compress_forget()
+{
+    for (int ii = 0; ii < ZCACHE_SIZE; ++ii) {
+        zcache[ii].pnum = 0;
+    }
+}
+
+// gets the contents of the pidx'th page of a compressed cluster
+const char*
+compress_read(inode* node, int pidx)
+{
+    int first = pidx - pidx % ZCLUSTER;
+    char* data = compress_load(node, first);
+    return data ? data + (pidx - first) * PAGE_BYTES : NULL;
+}
+
+// turns the compressed cluster holding page pidx back into plain pages so
+// it can be written to. Does nothing if it isn't compressed.
+int
+compress_expand(inode* node, int pidx)
+{
+    int first = pidx - pidx % ZCLUSTER;
+    if (!(inode_get_ptr(node, first) & PTR_Z)) {
+        return 0;
+    }
+    char* data = compress_load(node, first);
+    if (data == NULL) {
+        return -1;
+    }
+
+    int ptrs[ZCLUSTER];
+    for (int ii = 0; ii < ZCLUSTER; ++ii) {
+        ptrs[ii] = alloc_page();
+        if (ptrs[ii] < 0) {
+            for (int jj = 0; jj < ii; ++jj) {
+                free_page(ptrs[jj]);
+            }
+            return -1;
+        }
+        memcpy(pages_get_page(ptrs[ii]), data + ii * PAGE_BYTES, PAGE_BYTES);
+        page_written(ptrs[ii]);
+    }
+    return compress_swap(node, first, ptrs);
+}
@@ -0,0 +1,17 @@
+// transparent compression of file data in clusters of pages
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define ZCLUSTER 4 // file pages compressed together
+
+int lz_compress(const char* src, int len, char* dst, int cap);
+int lz_decompress(const char* src, int len, char* dst, int cap);
+int compress_inode(inode* node);
+int compress_expand(inode* node, int pidx);
+const char* compress_read(inode* node, int pidx);
+void compress_forget();
+
+#endif
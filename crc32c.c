@@ -0,0 +1,77 @@
+// Implementation of crc32c.h
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it, 8 bytes at a
+// time, and a byte-wise table otherwise.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static uint32_t crc_table[256];
+
+static void
+crc32c_init_table()
+{
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (int jj = 0; jj < 8; ++jj) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+        }
+        crc_table[ii] = crc;
+    }
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t* buf, size_t len)
+{
+    if (crc_table[1] == 0) {
+        crc32c_init_table();
+    }
+    for (size_t ii = 0; ii < len; ++ii) {
+        crc = crc_table[(crc ^ buf[ii]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* buf, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *buf++);
+        --len;
+    }
+    return crc;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void* buf, size_t len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int have_sse42 = -1;
+    if (have_sse42 < 0) {
+        have_sse42 = __builtin_cpu_supports("sse4.2");
+    }
+    if (have_sse42) {
+        return ~crc32c_hw(crc, buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
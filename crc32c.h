@@ -0,0 +1,11 @@
+// CRC-32C (Castagnoli), as used for page checksums
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif
@@ -0,0 +1,245 @@
+// Implementation of dedup.h
+//
+// Every data page written whole gets a fingerprint, kept per page on the
+// image next to the page refcounts. At mount we index the fingerprints in
+// memory (chains of page numbers per hash bucket). A page whose contents
+// are already stored somewhere just takes a reference on that page
+// instead of a page of its own; the copy-on-write paths take care of
+// splitting it again when one of the sharers writes.
+//
+// The on-image fingerprint is cleared whenever the page is allocated,
+// freed or changed, so a stale index entry is recognized by its page no
+// longer carrying the same fingerprint. Candidates are always compared
+// byte for byte before sharing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "log.h"
+
+static int*      dedup_head = 0; // first page in each bucket, 0 if none
+static int*      dedup_next = 0; // next page in the same bucket
+static uint32_t* dedup_key  = 0; // hash each page is indexed under
+static int       dedup_mask = 0;
+static dedup_stats stats;
+
+static long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// builds the in-memory index from the fingerprints on the image
+void
+dedup_init()
+{
+    int buckets = 1;
+    while (buckets < PAGE_COUNT) {
+        buckets *= 2;
+    }
+    dedup_mask = buckets - 1;
+    dedup_head = calloc(buckets, sizeof(int));
+    dedup_next = calloc(PAGE_COUNT, sizeof(int));
+    dedup_key  = calloc(PAGE_COUNT, sizeof(uint32_t));
+
+    uint32_t* fps = get_page_fps();
+    for (int ii = 1; ii < PAGE_COUNT; ++ii) {
+        if (fps[ii] && bitmap_get(get_pages_bitmap(), ii)) {
+            dedup_insert(ii, fps[ii]);
+        }
+    }
+}
+
+// drops the index, before the image is closed
+void
+dedup_free()
+{
+    free(dedup_head);
+    free(dedup_next);
+    free(dedup_key);
+    dedup_head = dedup_next = 0;
+    dedup_key = 0;
+}
+
+// a 32 bit fingerprint of a page, never 0. Four independent lanes of
+// multiply-xorshift so the multiplies overlap.
+uint32_t
+dedup_hash(const void* page)
+{
+    const uint64_t* words = page;
+    uint64_t h0 = 0x9e3779b97f4a7c15, h1 = 0xc2b2ae3d27d4eb4f;
+    uint64_t h2 = 0x165667b19e3779f9, h3 = 0x27d4eb2f165667c5;
+    for (int ii = 0; ii < PAGE_BYTES / 8; ii += 4) {
+        h0 = (h0 ^ words[ii + 0]) * 0xff51afd7ed558ccd;
+        h1 = (h1 ^ words[ii + 1]) * 0xff51afd7ed558ccd;
+        h2 = (h2 ^ words[ii + 2]) * 0xff51afd7ed558ccd;
+        h3 = (h3 ^ words[ii + 3]) * 0xff51afd7ed558ccd;
+        h0 ^= h0 >> 29;
+        h1 ^= h1 >> 29;
+        h2 ^= h2 >> 29;
+        h3 ^= h3 >> 29;
+    }
+    uint64_t h = h0 ^ (h1 * 31) ^ (h2 * 961) ^ (h3 * 29791);
+    h ^= h >> 32;
+    return (uint32_t)h ? (uint32_t)h : 1;
+}
+
+static void
+dedup_unlink(int pnum)
+{
+    int* link = &dedup_head[dedup_key[pnum] & dedup_mask];
+    while (*link != 0) {
+        if (*link == pnum) {
+            *link = dedup_next[pnum];
+            break;
+        }
+        link = &dedup_next[*link];
+    }
+    dedup_key[pnum] = 0;
+}
+
+// finds a page holding exactly data that can take another reference, 0
+// if there is none
+int
+dedup_find(uint32_t hash, const void* data)
+{
+    uint32_t* fps = get_page_fps();
+    int pnum = dedup_head[hash & dedup_mask];
+    while (pnum != 0) {
+        int next = dedup_next[pnum];
+        if (fps[pnum] != dedup_key[pnum]) {
+            // freed or rewritten since we indexed it
+            dedup_unlink(pnum);
+        }
+        else if (fps[pnum] == hash && page_refs(pnum) < PAGE_REFS_SHARE
+                 && memcmp(pages_get_page(pnum), data, PAGE_BYTES) == 0) {
+            return pnum;
+        }
+        pnum = next;
+    }
+    return 0;
+}
+
+// records that pnum holds a page with the given fingerprint
+void
+dedup_insert(int pnum, uint32_t hash)
+{
+    if (dedup_key[pnum]) {
+        dedup_unlink(pnum);
+    }
+    int bucket = hash & dedup_mask;
+    dedup_next[pnum] = dedup_head[bucket];
+    dedup_head[bucket] = pnum;
+    dedup_key[pnum] = hash;
+    get_page_fps()[pnum] = hash;
+}
+
+// the page is about to change, its fingerprint no longer holds
+void
+dedup_forget(int pnum)
+{
+    get_page_fps()[pnum] = 0;
+}
+
+// stores a whole page of data as the pidx'th page of node, sharing an
+// identical page if there is one. Returns 0 if the data went into a page
+// of the node's own, 1 if it was shared, -1 if we ran out of pages.
+int
+dedup_write_page(inode* node, int pidx, const void* data)
+{
+    long t0 = now_ns();
+    uint32_t hash = dedup_hash(data);
+    long t1 = now_ns();
+    stats.hash_ns += t1 - t0;
+    stats.pages_written += 1;
+
+    int old = inode_get_ptr(node, pidx);
+    uint32_t* fps = get_page_fps();
+    int same = old != 0 && fps[old] == hash
+        && memcmp(pages_get_page(old), data, PAGE_BYTES) == 0;
+    int match = same ? old : dedup_find(hash, data);
+    stats.lookup_ns += now_ns() - t1;
+
+    if (match == old && old != 0) {
+        // rewriting what's already there
+        stats.pages_shared += page_refs(old) > 1;
+        return page_refs(old) > 1;
+    }
+    if (match != 0) {
+        page_ref(match);
+        if (inode_set_ptr(node, pidx, match) < 0) {
+            free_page(match);
+            return -1;
+        }
+        free_page(old);
+        stats.pages_shared += 1;
+        return 1;
+    }
+
+    int pnum = inode_write_pnum(node, pidx * PAGE_BYTES);
+    if (pnum < 0) {
+        return -1;
+    }
+    memcpy(pages_get_page(pnum), data, PAGE_BYTES);
+    page_written(pnum);
+    dedup_insert(pnum, hash);
+    return 0;
+}
+
+// batch pass over every live file, sharing identical pages. Returns the
+// number of pages that were freed up.
+int
+dedup_all()
+{
+    int freed = 0;
+    for (int inum = 0; inum < INODE_COUNT; ++inum) {
+        if (!bitmap_get(get_inode_bitmap(), inum)) {
+            continue;
+        }
+        inode* node = get_inode(inum);
+        if (!S_ISREG(node->mode)) {
+            continue;
+        }
+        for (int pidx = 0; pidx <= node->size / PAGE_BYTES; ++pidx) {
+            int pnum = inode_get_ptr(node, pidx);
+            if (pnum <= 0 || (pnum & PTR_Z)) {
+                continue;
+            }
+            uint32_t* fps = get_page_fps();
+            uint32_t hash = fps[pnum] ? fps[pnum] : dedup_hash(pages_get_page(pnum));
+            int match = dedup_find(hash, pages_get_page(pnum));
+            if (match == pnum) {
+                continue;
+            }
+            if (match == 0) {
+                dedup_insert(pnum, hash);
+                continue;
+            }
+            page_ref(match);
+            if (inode_set_ptr(node, pidx, match) < 0) {
+                free_page(match);
+                return freed;
+            }
+            int before = page_refs(pnum);
+            free_page(pnum);
+            freed += before == 1;
+        }
+    }
+    log_info("+ dedup_all() -> %d pages freed\n", freed);
+    return freed;
+}
+
+dedup_stats*
+get_dedup_stats()
+{
+    return &stats;
+}
@@ -0,0 +1,27 @@
+// content-addressed sharing of identical data pages
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+typedef struct dedup_stats {
+    long pages_written; // full pages that went through the dedup check
+    long pages_shared;  // of those, how many ended up sharing a page
+    long hash_ns;       // time spent fingerprinting
+    long lookup_ns;     // time spent searching and comparing candidates
+} dedup_stats;
+
+void dedup_init();
+void dedup_free();
+uint32_t dedup_hash(const void* page);
+int dedup_find(uint32_t hash, const void* data);
+void dedup_insert(int pnum, uint32_t hash);
+void dedup_forget(int pnum);
+int dedup_write_page(inode* node, int pidx, const void* data);
+int dedup_all();
+dedup_stats* get_dedup_stats();
+
+#endif
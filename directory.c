@@ -5,57 +5,523 @@
 #include "inode.h"
 #include "directory.h"
 #include "bitmap.h"
+#include "util.h"
+#include "log.h"
+#include "stats.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 /*
 typedef struct dirent {
-    char name[DIR_NAME]; // The name of the directory
-    int  inum; // the number of the inode in the inode table?
-    char used; // is this used?
-    char _reserved[11]; // rounding things out
+    int32_t inum; // the number of the inode in the inode table
+    uint8_t len; // of the name, without the NUL
+    char    name[]; // NUL terminated
 } dirent; */
 
+// Directory pages are slotted pages: a header, an array of slots growing
+// from the front and the entries packed in from the back, each only as
+// long as its name. A slot holds the hash of its entry's name and where
+// the entry is, so a lookup scans the hashes and only looks at the names
+// that match, and entries can be moved to close up the holes deleted ones
+// leave without their slot changing. Slot numbers are what readdir hands
+// out as cookies. The size of a directory is kept just short of its last
+// page's end, so grow_inode and friends see exactly its pages.
+//
+// Directories from before this have fixed 64 byte entries
+// (legacy_dirent) and no INODE_PACKED. They are read as they are and
+// packed the first time they change.
+
+typedef struct dirslot {
+    uint32_t hash; // directory_hash of the name, 0 if the slot is free
+    uint32_t off;  // of the entry in the page
+} dirslot;
+
+typedef struct dirpage {
+    uint32_t nslots; // slots in the array, used or free
+    uint32_t nfree;  // of those, the free ones
+    uint32_t names;  // where the entries start, the gap ends here
+    uint32_t dead;   // bytes of deleted entries above names
+    dirslot  slots[];
+} dirpage;
+
+typedef struct legacy_dirent {
+    char     name[48];
+    int32_t  inum;
+    char     used;
+    uint8_t  len;
+    uint16_t _pad;
+    uint32_t hash;
+    uint32_t _reserved;
+} legacy_dirent;
+
+#define LEGACY_PER_PAGE ((int)(PAGE_BYTES / sizeof(legacy_dirent)))
+// the most slots a page can have, an entry and its slot take 16 bytes or more
+#define DIR_SLOTS (PAGE_BYTES / 16)
+
+// bytes an entry with a name of len takes, kept aligned for the inum
+static int
+dirent_size(int len) {
+    return (offsetof(dirent, name) + len + 1 + 3) & ~3;
+}
+
+static int
+directory_npages(inode* dd) {
+    return dd->size ? dd->size / PAGE_BYTES + 1 : 0;
+}
+
+// the free bytes between the slots and the entries
+static int
+dirpage_gap(dirpage* page) {
+    return page->names - sizeof(dirpage) - page->nslots * sizeof(dirslot);
+}
+
+// does the header make sense? Checked before we trust any offsets in it.
+static int
+dirpage_ok(dirpage* page) {
+    return page->names <= PAGE_BYTES && page->nslots <= DIR_SLOTS
+        && sizeof(dirpage) + page->nslots * sizeof(dirslot) <= page->names;
+}
+
+// gets the entry in a used slot, NULL if it would run off the page
+static dirent*
+dirpage_entry(dirpage* page, int slot) {
+    uint32_t off = page->slots[slot].off;
+    if (off < page->names || off + offsetof(dirent, name) >= PAGE_BYTES) {
+        return NULL;
+    }
+    dirent* entry = (dirent*)((char*)page + off);
+    if (off + dirent_size(entry->len) > PAGE_BYTES) {
+        return NULL;
+    }
+    return entry;
+}
+
+// gets the pidx'th page of dd to read, NULL if it is missing or damaged
+static void*
+directory_page(inode* dd, int pidx) {
+    if (pidx >= nptrs && (dd->iptr <= 0 || dd->iptr >= PAGE_COUNT)) {
+        return NULL;
+    }
+    int pnum = ptr_pnum(inode_get_ptr(dd, pidx));
+    if (pnum <= 0 || pnum >= PAGE_COUNT || page_verify_once(pnum) < 0) {
+        return NULL;
+    }
+    void* page = pages_get_page(pnum);
+    if ((dd->mode & INODE_PACKED) && !dirpage_ok(page)) {
+        return NULL;
+    }
+    return page;
+}
+
+// gets the pidx'th page of dd to change it, pnum gets the page to mark
+// written. Before changing it we need our own copy of the page, since a
+// snapshot or a clone may still share it.
+static dirpage*
+directory_edit(inode* dd, int pidx, int* pnum) {
+    *pnum = inode_write_pnum(dd, pidx * PAGE_BYTES);
+    if (*pnum < 0) {
+        return NULL;
+    }
+    return pages_get_page(*pnum);
+}
+
+// FNV-1a of the name, never 0 so 0 can mark a free slot
+uint32_t
+directory_hash(const char* name) {
+    uint32_t hh = 2166136261u;
+    for (; *name; ++name) {
+        hh = (hh ^ (uint8_t)*name) * 16777619u;
+    }
+    return hh ? hh : 1;
+}
+
+static int
+dirpage_match(dirpage* page, int slot, const char* name, int len) {
+    dirent* entry = dirpage_entry(page, slot);
+    return entry && entry->len == len && memcmp(entry->name, name, len) == 0;
+}
+
+// finds name (with its length and hash) on a page, returns its slot or -1
+static int
+dirpage_scan(dirpage* page, int first, const char* name, int len, uint32_t hh) {
+    for (int ii = first; ii < page->nslots; ++ii) {
+        if (page->slots[ii].hash == hh && dirpage_match(page, ii, name, len)) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+#ifdef __x86_64__
+// the same with AVX2, comparing the hashes of 8 slots at a time and only
+// looking at the names of the ones that match
+__attribute__((target("avx2")))
+static int
+dirpage_scan_avx2(dirpage* page, int first, const char* name, int len, uint32_t hh) {
+    __m256i want = _mm256_set1_epi32(hh);
+    int ii = first;
+    for (; ii + 8 <= page->nslots; ii += 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)&page->slots[ii]);
+        __m256i hi = _mm256_loadu_si256((const __m256i*)&page->slots[ii + 4]);
+        int mlo = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lo, want)));
+        int mhi = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(hi, want)));
+        // hashes are in the even lanes, offsets in the odd ones
+        int mask = (mlo & 0x55) | ((mhi & 0x55) << 8);
+        while (mask) {
+            int jj = ii + __builtin_ctz(mask) / 2;
+            if (dirpage_match(page, jj, name, len)) {
+                return jj;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return dirpage_scan(page, ii, name, len, hh);
+}
+#endif
+
+typedef int (*scan_fn)(dirpage* page, int first, const char* name, int len, uint32_t hh);
+
+static scan_fn
+directory_scanner() {
+    static scan_fn scan = NULL;
+    if (scan == NULL) {
+        scan = dirpage_scan;
+#ifdef __x86_64__
+        if (__builtin_cpu_supports("avx2")) {
+            scan = dirpage_scan_avx2;
+        }
+#endif
+    }
+    return scan;
+}
+
+// finds the entry called name in a packed directory, pidx and slot get
+// where it is. Returns NULL if there isn't one.
+static dirent*
+directory_find(inode* dd, const char* name, int* pidx, int* slot) {
+    int len = strlen(name);
+    if (len >= DIR_NAME) {
+        return NULL;
+    }
+    uint32_t hh = directory_hash(name);
+    scan_fn scan = directory_scanner();
+    int npages = directory_npages(dd);
+    for (int pp = 0; pp < npages; ++pp) {
+        dirpage* page = directory_page(dd, pp);
+        if (page == NULL) {
+            continue;
+        }
+        int ss = scan(page, 0, name, len, hh);
+        if (ss >= 0) {
+            *pidx = pp;
+            *slot = ss;
+            return dirpage_entry(page, ss);
+        }
+    }
+    return NULL;
+}
+
+// moves the live entries to the back of the page, closing up the holes
+static void
+dirpage_compact(dirpage* page) {
+    static char buf[MAX_PAGE_BYTES];
+    int names = PAGE_BYTES;
+    for (int ii = 0; ii < page->nslots; ++ii) {
+        if (page->slots[ii].hash == 0) {
+            continue;
+        }
+        dirent* entry = dirpage_entry(page, ii);
+        if (entry == NULL) {
+            // can't be moved, so let it go
+            page->slots[ii].hash = 0;
+            page->nfree += 1;
+            continue;
+        }
+        int size = dirent_size(entry->len);
+        names -= size;
+        memcpy(buf + names, entry, size);
+        page->slots[ii].off = names;
+    }
+    memcpy((char*)page + names, buf + names, PAGE_BYTES - names);
+    page->names = names;
+    page->dead = 0;
+}
+
+// can the page take an entry of size bytes, compacting it if need be?
+static int
+dirpage_fits(dirpage* page, int size) {
+    int need = size + (page->nfree ? 0 : sizeof(dirslot));
+    return dirpage_gap(page) + page->dead >= need;
+}
+
+// puts an entry on a page it fits on, returns its slot
+static int
+dirpage_add(dirpage* page, const char* name, int len, int inum) {
+    int size = dirent_size(len);
+    if (dirpage_gap(page) < size + (page->nfree ? 0 : sizeof(dirslot))) {
+        dirpage_compact(page);
+    }
+    int slot = page->nslots;
+    if (page->nfree) {
+        for (slot = 0; page->slots[slot].hash != 0; ++slot) {
+        }
+        page->nfree -= 1;
+    }
+    else {
+        page->nslots += 1;
+    }
+
+    page->names -= size;
+    dirent* entry = (dirent*)((char*)page + page->names);
+    memset(entry, 0, size);
+    entry->inum = inum;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    page->slots[slot].hash = directory_hash(entry->name);
+    page->slots[slot].off = page->names;
+    return slot;
+}
+
+// frees the slot, its entry becomes a hole
+static void
+dirpage_remove(dirpage* page, int slot) {
+    dirent* entry = dirpage_entry(page, slot);
+    if (entry != NULL && page->slots[slot].off == page->names) {
+        page->names += dirent_size(entry->len);
+    }
+    else if (entry != NULL) {
+        page->dead += dirent_size(entry->len);
+    }
+    page->slots[slot].hash = 0;
+    page->nfree += 1;
+    // free slots at the end go back to the gap
+    while (page->nslots > 0 && page->slots[page->nslots - 1].hash == 0) {
+        page->nslots -= 1;
+        page->nfree -= 1;
+    }
+}
+
+// packs a legacy directory. The packed pages are filled before the old
+// ones are let go, so running out of space leaves it as it was.
+static int
+directory_pack(inode* dd) {
+    inode packed;
+    memset(&packed, 0, sizeof(packed));
+    packed.mode = dd->mode | INODE_PACKED;
+
+    int count = dd->size / sizeof(legacy_dirent);
+    legacy_dirent* entries = NULL;
+    int slot = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        if (ii % LEGACY_PER_PAGE == 0) {
+            entries = directory_page(dd, ii / LEGACY_PER_PAGE);
+        }
+        legacy_dirent* old = entries ? &entries[ii % LEGACY_PER_PAGE] : NULL;
+        if (old == NULL || !old->used) {
+            continue;
+        }
+        char name[sizeof(old->name)];
+        memcpy(name, old->name, sizeof(name));
+        name[sizeof(name) - 1] = 0;
+        if (directory_put_next(&packed, name, old->inum, &slot) < 0) {
+            inode_release(&packed);
+            return -ENOSPC;
+        }
+    }
+    log_info("+ directory_pack() -> %d pages for %d entries\n", directory_npages(&packed), count);
+
+    inode_release(dd);
+    for (int ii = 0; ii < nptrs; ++ii) {
+        dd->ptrs[ii] = packed.ptrs[ii];
+    }
+    dd->iptr = packed.iptr;
+    dd->size = packed.size;
+    dd->mode = packed.mode;
+    return 0;
+}
+
+// directories are packed before anything in them changes
+static int
+directory_packed(inode* dd) {
+    if (dd->mode & INODE_PACKED) {
+        return 0;
+    }
+    if (dd->size == 0) {
+        dd->mode |= INODE_PACKED;
+        return 0;
+    }
+    return directory_pack(dd);
+}
+
+// finds name in a legacy directory, returns its inode or -1
+static int
+legacy_lookup(inode* dd, const char* name) {
+    int count = dd->size / sizeof(legacy_dirent);
+    legacy_dirent* entries = NULL;
+    for (int ii = 0; ii < count; ++ii) {
+        if (ii % LEGACY_PER_PAGE == 0) {
+            entries = directory_page(dd, ii / LEGACY_PER_PAGE);
+        }
+        legacy_dirent* entry = entries ? &entries[ii % LEGACY_PER_PAGE] : NULL;
+        if (entry && entry->used && strncmp(entry->name, name, sizeof(entry->name)) == 0) {
+            return entry->inum;
+        }
+    }
+    return -1;
+}
+
+// directory_walk for a legacy directory, slots are entry numbers
+static int
+legacy_walk(inode* dd, int slot, dirent_fn fn, void* arg) {
+    union {
+        dirent entry;
+        char   buf[sizeof(dirent) + sizeof(((legacy_dirent*)0)->name)];
+    } view;
+    int count = dd->size / sizeof(legacy_dirent);
+    legacy_dirent* entries = NULL;
+    for (int ii = slot; ii < count; ++ii) {
+        if (entries == NULL || ii % LEGACY_PER_PAGE == 0) {
+            entries = directory_page(dd, ii / LEGACY_PER_PAGE);
+            if (entries == NULL) {
+                ii += LEGACY_PER_PAGE - 1 - ii % LEGACY_PER_PAGE;
+                continue;
+            }
+        }
+        legacy_dirent* old = &entries[ii % LEGACY_PER_PAGE];
+        if (!old->used) {
+            continue;
+        }
+        view.entry.inum = old->inum;
+        view.entry.len = strnlen(old->name, sizeof(old->name) - 1);
+        memcpy(view.entry.name, old->name, view.entry.len);
+        view.entry.name[view.entry.len] = 0;
+        int rv = fn(&view.entry, ii, arg);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
 
 void directory_init() {
     // we already have our page for the inodes allocated
     // the root inode will be node 0
     inode* rootnode = get_inode(alloc_inode());
     rootnode->mode = 040755;
+    // the root is its own parent
+    directory_put(rootnode, "..", 0);
 }
 
-int 
+int
 directory_lookup(inode* dd, const char* name) {
-    printf("looking for \"%s\" in dirlookup\n", name);
+    log_debug("looking for \"%s\" in dirlookup\n", name);
     if (!strcmp(name, "")) {
-        printf("this is root, returning 0\n");
-        return 0; 
+        log_debug("this is root, returning 0\n");
+        return 0;
     }
-    dirent* subdirs = pages_get_page(dd->ptrs[0]);
-    for (int ii = 0; ii < 64; ++ii) {
-        dirent csubdir = subdirs[ii];
-        if (strcmp(name, csubdir.name) == 0 && csubdir.used) {
-            printf("found a match! returning %d\n", csubdir.inum);
-            return csubdir.inum;
-        }
+    if (!(dd->mode & INODE_PACKED)) {
+        return legacy_lookup(dd, name);
+    }
+    int pidx, slot;
+    dirent* match = directory_find(dd, name, &pidx, &slot);
+    if (match != NULL) {
+        log_debug("found a match! returning %d\n", match->inum);
+        stats_count(dirent_hits, 1);
+        return match->inum;
     }
+    stats_count(dirent_misses, 1);
     // if we can't find something that matches the name, return -1
     return -1;
 }
 
+typedef struct lookup_batch {
+    const char** names;
+    int*         table; // open addressing, index into names or -1
+    int          mask;
+    int*         inums;
+} lookup_batch;
+
+static void
+lookup_batch_check(lookup_batch* batch, const char* name, uint32_t hh, int inum) {
+    for (int ii = hh & batch->mask; batch->table[ii] >= 0; ii = (ii + 1) & batch->mask) {
+        if (strcmp(batch->names[batch->table[ii]], name) == 0) {
+            batch->inums[batch->table[ii]] = inum;
+            return;
+        }
+    }
+}
+
+static int
+lookup_batch_entry(dirent* entry, int slot, void* arg) {
+    lookup_batch_check(arg, entry->name, directory_hash(entry->name), entry->inum);
+    return 0;
+}
+
+// looks up count names in one pass over dd, inums[ii] gets the inode
+// names[ii] is at or -1. The names go in a hash table first, so this costs
+// one scan of the directory however many names there are.
+void
+directory_lookup_many(inode* dd, const char** names, int count, int* inums) {
+    int size = 16;
+    while (size < 2 * count) {
+        size *= 2;
+    }
+    lookup_batch batch = { names, malloc(size * sizeof(int)), size - 1, inums };
+    memset(batch.table, -1, size * sizeof(int));
+    int* first = malloc(count * sizeof(int)); // a name asked for twice shares a slot
+    for (int ii = 0; ii < count; ++ii) {
+        int hh = directory_hash(names[ii]) & batch.mask;
+        while (batch.table[hh] >= 0 && strcmp(names[batch.table[hh]], names[ii]) != 0) {
+            hh = (hh + 1) & batch.mask;
+        }
+        if (batch.table[hh] < 0) {
+            batch.table[hh] = ii;
+        }
+        first[ii] = batch.table[hh];
+        inums[ii] = -1;
+    }
+
+    if (!(dd->mode & INODE_PACKED)) {
+        directory_walk(dd, 0, lookup_batch_entry, &batch);
+    }
+    else {
+        // the slots already have the hashes
+        for (int pp = 0; pp < directory_npages(dd); ++pp) {
+            dirpage* page = directory_page(dd, pp);
+            for (int ss = 0; page != NULL && ss < page->nslots; ++ss) {
+                dirent* entry = page->slots[ss].hash ? dirpage_entry(page, ss) : NULL;
+                if (entry != NULL) {
+                    lookup_batch_check(&batch, entry->name, page->slots[ss].hash, entry->inum);
+                }
+            }
+        }
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        inums[ii] = inums[first[ii]];
+    }
+    free(first);
+    free(batch.table);
+}
+
 // not sure if that's any different but imma use this to parse
-int 
+int
 tree_lookup(const char* path) {
-    int ii = 0;
-    int jj = 0;
     int curnode = 0;
-    
+
     // creates an slist with all the dir names and the file name
     slist* pathlist = s_split(path, '/');
     slist* currdir = pathlist;
+    stats_count(lookups, 1);
     while (currdir != NULL) {
         // we look for the name of the next dir in the current one
+        stats_count(lookup_depth, currdir->data[0] != 0);
         curnode = directory_lookup(get_inode(curnode), currdir->data);
         if (curnode == -1) {
             s_free(pathlist);
@@ -64,76 +530,222 @@ tree_lookup(const char* path) {
         currdir = currdir->next;
     }
     s_free(pathlist);
-    printf("tree lookup: %s is at node %d\n", path, curnode);
+    log_debug("tree lookup: %s is at node %d\n", path, curnode);
     return curnode;
 }
-    
+
 // puts a new directory entry into the dir at dd that points to inode inum
 int directory_put(inode* dd, const char* name, int inum) {
-    int numentries = dd->size / sizeof(dirent);
-    dirent* entries = pages_get_page(dd->ptrs[0]);
-    int alloced = 0; // we want to keep track of whether we've alloced or not
+    int slot = 0;
+    return directory_put_next(dd, name, inum, &slot);
+}
 
-    // building the new directory entry;
-    dirent new;
-    strncpy(new.name, name, DIR_NAME); 
-    new.inum = inum;
-    new.used = 1;
+// like directory_put, but only looks for room from the page of *slot on
+// and leaves *slot at the new entry, so a batch of puts into the same
+// directory doesn't look through the pages it already filled
+int directory_put_next(inode* dd, const char* name, int inum, int* slot) {
+    int len = strlen(name);
+    if (len >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (directory_packed(dd) < 0) {
+        return -ENOSPC;
+    }
 
-    for (int ii = 1; ii < dd->size / sizeof(dirent); ++ii) {
-        if (entries[ii].used == 0) {
-            entries[ii] = new;
-            alloced = 1;
+    int npages = directory_npages(dd);
+    int pidx = max(*slot, 0) / DIR_SLOTS;
+    for (; pidx < npages; ++pidx) {
+        dirpage* page = directory_page(dd, pidx);
+        if (page && dirpage_fits(page, dirent_size(len))) {
+            break;
+        }
+    }
+    // every page is full, add one, its page comes from directory_edit
+    int64_t size = dd->size;
+    if (pidx >= npages) {
+        pidx = npages;
+        if (grow_inode(dd, pidx * PAGE_BYTES + PAGE_BYTES - 1) < 0) {
+            return -ENOSPC;
         }
     }
-    
-    if (!alloced) {
-        entries[numentries] = new;
-        dd->size = dd->size + sizeof(dirent);
+
+    int pnum;
+    dirpage* page = directory_edit(dd, pidx, &pnum);
+    if (page == NULL) {
+        dd->size = size;
+        return -ENOSPC;
+    }
+    if (page->names == 0) {
+        // a new page
+        page->nslots = 0;
+        page->nfree = 0;
+        page->names = PAGE_BYTES;
+        page->dead = 0;
     }
+    int ss = dirpage_add(page, name, len, inum);
+    page_written(pnum);
+    *slot = pidx * DIR_SLOTS + ss;
+    log_debug("running dir_put, putting %s, inum %d, in slot %d\n", name, inum, *slot);
+    return 0;
+}
+
+// gets the page holding the entry called name to change it
+static dirpage*
+directory_find_edit(inode* dd, const char* name, int* slot, int* pnum) {
+    int pidx;
+    if (directory_packed(dd) < 0 || directory_find(dd, name, &pidx, slot) == NULL) {
+        return NULL;
+    }
+    return directory_edit(dd, pidx, pnum);
+}
 
-    printf("running dir_put, putting %s, inum %d, on page %d\n", name, inum, dd->ptrs[0]);
+// repoints the entry called name at inum; the old inode's refs are left
+// for the caller to drop once nothing can see it through this entry
+int directory_set(inode* dd, const char* name, int inum) {
+    int slot, pnum;
+    dirpage* page = directory_find_edit(dd, name, &slot, &pnum);
+    if (page == NULL) {
+        return -ENOENT;
+    }
+    dirpage_entry(page, slot)->inum = inum;
+    page_written(pnum);
+    return 0;
+}
+
+// renames the entry called from to to, on the old entry's page if the new
+// name fits there once the old one is gone. Otherwise the new entry goes
+// wherever there is room before the old one is taken out, so running out
+// of room leaves the directory as it was.
+int directory_rename(inode* dd, const char* from, const char* to) {
+    int len = strlen(to);
+    if (len >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    int slot, pnum;
+    dirpage* page = directory_find_edit(dd, from, &slot, &pnum);
+    if (page == NULL) {
+        return -ENOENT;
+    }
+    dirent* entry = dirpage_entry(page, slot);
+    int inum = entry->inum;
+    // removing the old entry frees its bytes and its slot
+    if (dirpage_gap(page) + page->dead + dirent_size(entry->len) >= dirent_size(len)) {
+        dirpage_remove(page, slot);
+        dirpage_add(page, to, len, inum);
+        page_written(pnum);
+        return 0;
+    }
+    int rv = directory_put(dd, to, inum);
+    if (rv < 0) {
+        return rv;
+    }
+    return directory_detach(dd, from);
+}
+
+// takes the entry out of the directory but leaves its inode alone
+int directory_detach(inode* dd, const char* name) {
+    int slot, pnum;
+    dirpage* page = directory_find_edit(dd, name, &slot, &pnum);
+    if (page == NULL) {
+        return -ENOENT;
+    }
+    dirpage_remove(page, slot);
+    page_written(pnum);
+
+    // give back empty pages at the end
+    int npages = directory_npages(dd);
+    while (npages > 1 && page->nslots == 0 && pnum == ptr_pnum(inode_get_ptr(dd, npages - 1))) {
+        shrink_inode(dd, (npages - 1) * PAGE_BYTES - 1);
+        npages -= 1;
+        pnum = ptr_pnum(inode_get_ptr(dd, npages - 1));
+        page = directory_page(dd, npages - 1);
+        if (page == NULL) {
+            break;
+        }
+    }
     return 0;
 }
 
 // this sets the matching directory to unused and takes a ref off its inode
 int directory_delete(inode* dd, const char* name) {
-    printf("running dir delete on filename %s\n", name);
-    dirent* entries = pages_get_page(dd->ptrs[0]);
-    printf("got direntries at block %d\n", dd->ptrs[0]);
-    for (int ii = 0; ii < dd->size / sizeof(dirent); ++ii) {
-        if (strcmp(entries[ii].name, name) == 0) {
-            printf("found a deletion match at entry %d\n", ii);
-            entries[ii].used = 0;
-            decrease_refs(entries[ii].inum);
-            return 0;
+    log_debug("running dir delete on filename %s\n", name);
+    int inum = directory_lookup(dd, name);
+    if (inum < 0 || directory_detach(dd, name) < 0) {
+        log_debug("no file found! cannot delete\n");
+        return -ENOENT;
+    }
+    decrease_refs(inum);
+    return 0;
+}
+
+static int
+directory_not_dotdot(dirent* entry, int slot, void* arg) {
+    return strcmp(entry->name, "..") != 0;
+}
+
+// a directory is empty when nothing but its ".." entry is left
+int directory_empty(inode* dd) {
+    return directory_walk(dd, 0, directory_not_dotdot, NULL) == 0;
+}
+
+// calls fn on each entry of dd from slot on, in slot order, until fn
+// returns nonzero. A slot stays put while its entry lives, so it is a
+// place a listing can be picked up from later.
+int directory_walk(inode* dd, int slot, dirent_fn fn, void* arg) {
+    if (!(dd->mode & INODE_PACKED)) {
+        return legacy_walk(dd, slot, fn, arg);
+    }
+    int npages = directory_npages(dd);
+    for (int pidx = slot / DIR_SLOTS; pidx < npages; ++pidx) {
+        dirpage* page = directory_page(dd, pidx);
+        int first = pidx == slot / DIR_SLOTS ? slot % DIR_SLOTS : 0;
+        for (int ii = first; page != NULL && ii < page->nslots; ++ii) {
+            dirent* entry = page->slots[ii].hash ? dirpage_entry(page, ii) : NULL;
+            if (entry == NULL) {
+                continue;
+            }
+            int rv = fn(entry, pidx * DIR_SLOTS + ii, arg);
+            if (rv != 0) {
+                return rv;
+            }
         }
     }
-    printf("no file found! cannot delete");
-    return -ENOENT;
+    return 0;
 }
 
-// list of directories where? at the path? wait... this is for ls
-slist* directory_list(const char* path) {
-    int working_dir = tree_lookup(path);
-    inode* w_inode = get_inode(working_dir);
-    int numdirs = w_inode->size / sizeof(dirent);
-    dirent* dirs = pages_get_page(w_inode->ptrs[0]);
-    slist* dirnames = NULL; 
-    for (int ii = 0; ii < numdirs; ++ii) {
-        if (dirs[ii].used) {
-            dirnames = s_cons(dirs[ii].name, dirnames);
+// counts what is wrong with the pages of dd: pages that are missing or
+// have a bad header, and entries that run off their page or don't match
+// their hash. For fsck.
+int directory_check(inode* dd) {
+    int bad = 0;
+    int packed = dd->mode & INODE_PACKED;
+    int npages = directory_npages(dd);
+    for (int pidx = 0; pidx < npages; ++pidx) {
+        dirpage* page = directory_page(dd, pidx);
+        if (page == NULL) {
+            bad += 1;
+            continue;
+        }
+        for (int ii = 0; packed && ii < page->nslots; ++ii) {
+            if (page->slots[ii].hash == 0) {
+                continue;
+            }
+            dirent* entry = dirpage_entry(page, ii);
+            if (entry == NULL || entry->name[entry->len] != 0
+                || directory_hash(entry->name) != page->slots[ii].hash) {
+                bad += 1;
+            }
         }
     }
-    return dirnames;
+    return bad;
 }
 
+static int
+print_entry(dirent* entry, int slot, void* arg) {
+    printf("%s\n", entry->name);
+    return 0;
+}
 
 void print_directory(inode* dd) {
-    int numdirs = dd->size / sizeof(dirent);
-    dirent* dirs = pages_get_page(dd->ptrs[0]);
-    for (int ii = 0; ii < numdirs; ++ii) {
-        printf("%s\n", dirs[ii].name);
-    }
+    directory_walk(dd, 0, print_entry, NULL);
 }
-
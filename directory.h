@@ -3,26 +3,39 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME 48
+#define DIR_NAME 256 // longest name with its NUL
+
+#include <stdint.h>
 
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
 
+// an entry as it is kept on a directory page, see directory.c
 typedef struct dirent {
-    char name[DIR_NAME];// The name of the directory
-    int  inum; // the number of the inode in the inode table?
-    char used; // is this directory entry being used?
-    char _reserved[11]; // round it out to 64B
+    int32_t inum; // the number of the inode in the inode table
+    uint8_t len; // of the name, without the NUL
+    char    name[]; // NUL terminated
 } dirent;
 
+// called by directory_walk on each entry with its slot
+typedef int (*dirent_fn)(dirent* entry, int slot, void* arg);
+
 // not sure what this does
 void directory_init(); 
+uint32_t directory_hash(const char* name);
 int directory_lookup(inode* dd, const char* name);
+void directory_lookup_many(inode* dd, const char** names, int count, int* inums);
 int tree_lookup(const char* path);
 int directory_put(inode* dd, const char* name, int inum);
+int directory_put_next(inode* dd, const char* name, int inum, int* slot);
+int directory_set(inode* dd, const char* name, int inum);
+int directory_rename(inode* dd, const char* from, const char* to);
+int directory_detach(inode* dd, const char* name);
 int directory_delete(inode* dd, const char* name);
-slist* directory_list(const char* path);
+int directory_empty(inode* dd);
+int directory_walk(inode* dd, int slot, dirent_fn fn, void* arg);
+int directory_check(inode* dd);
 void print_directory(inode* dd);
 
 #endif
@@ -0,0 +1,405 @@
+// nufs-e2e: runs workloads against a mounted nufs
+//
+//   nufs-e2e [-t <threads>] [-n <files>] [-d <dirs>] [-f <file MB>]
+//            [-s <io size>] [-x <nufs>] [-o <mount options>] <mnt> [<image>]
+//
+// With an image, mounts it on mnt with the nufs binary (./nufs unless -x
+// says otherwise), waits until the mount is really there, runs the
+// workloads and unmounts. Without one, runs against whatever is mounted
+// on mnt already.
+//
+// The workloads run one phase at a time, -t threads each in a tree of its
+// own:
+//   mkdir, create, stat, unlink   mdtest style: -n files per thread spread
+//                                 over -d directories
+//   seq/rand write and read       fio style: one file of -f MB per thread,
+//                                 in calls of -s bytes
+// Reads start from a dropped page cache, so they go through FUSE.
+//
+// Each phase prints one JSON object per line: ops, seconds, ops/s, MB/s
+// and latency percentiles in microseconds over every call in the phase.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int    threads = 4;
+static int    files = 1000;
+static int    dirs = 10;
+static long   file_bytes = 4 << 20;
+static int    io_size = 65536;
+static char   mnt[PATH_MAX];
+
+// mnt and the names of a workload under it
+#define PATH_BYTES (PATH_MAX + 64)
+
+typedef struct worker {
+    int       id;
+    int       (*fn)(struct worker* ww);
+    long*     lat;   // ns of each call
+    long      nops;
+    long      bytes;
+    int       failed;
+    pthread_t thread;
+} worker;
+
+static long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void
+record(worker* ww, long start, long bytes)
+{
+    ww->lat[ww->nops++] = now_ns() - start;
+    ww->bytes += bytes;
+}
+
+static void
+file_path(char* buf, worker* ww, int ii)
+{
+    sprintf(buf, "%s/md/t%d/d%d/f%d", mnt, ww->id, ii % dirs, ii);
+}
+
+static int
+do_mkdir(worker* ww)
+{
+    char path[PATH_BYTES];
+    sprintf(path, "%s/md/t%d", mnt, ww->id);
+    long start = now_ns();
+    if (mkdir(path, 0755) < 0) {
+        return -1;
+    }
+    record(ww, start, 0);
+    for (int dd = 0; dd < dirs; ++dd) {
+        sprintf(path, "%s/md/t%d/d%d", mnt, ww->id, dd);
+        start = now_ns();
+        if (mkdir(path, 0755) < 0) {
+            return -1;
+        }
+        record(ww, start, 0);
+    }
+    return 0;
+}
+
+static int
+do_create(worker* ww)
+{
+    char path[PATH_BYTES];
+    for (int ii = 0; ii < files; ++ii) {
+        file_path(path, ww, ii);
+        long start = now_ns();
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        close(fd);
+        record(ww, start, 0);
+    }
+    return 0;
+}
+
+static int
+do_stat(worker* ww)
+{
+    char path[PATH_BYTES];
+    struct stat st;
+    for (int ii = 0; ii < files; ++ii) {
+        file_path(path, ww, ii);
+        long start = now_ns();
+        if (stat(path, &st) < 0) {
+            return -1;
+        }
+        record(ww, start, 0);
+    }
+    return 0;
+}
+
+static int
+do_unlink(worker* ww)
+{
+    char path[PATH_BYTES];
+    for (int ii = 0; ii < files; ++ii) {
+        file_path(path, ww, ii);
+        long start = now_ns();
+        if (unlink(path) < 0) {
+            return -1;
+        }
+        record(ww, start, 0);
+    }
+    return 0;
+}
+
+// seq or rand, write or read, over the thread's file
+static int
+do_io(worker* ww, int writing, int random)
+{
+    char path[PATH_BYTES];
+    sprintf(path, "%s/io/t%d", mnt, ww->id);
+    int fd = open(path, writing ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!writing) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    char* buf = malloc(io_size);
+    memset(buf, 'a' + ww->id % 26, io_size);
+    long calls = file_bytes / io_size;
+    unsigned int seed = ww->id + 1;
+    int rv = 0;
+    for (long ii = 0; ii < calls && rv == 0; ++ii) {
+        off_t off = (random ? rand_r(&seed) % calls : ii) * io_size;
+        long start = now_ns();
+        ssize_t done = writing ? pwrite(fd, buf, io_size, off) : pread(fd, buf, io_size, off);
+        if (done != io_size) {
+            rv = -1;
+            break;
+        }
+        record(ww, start, done);
+    }
+    free(buf);
+    close(fd);
+    return rv;
+}
+
+static int do_seq_write(worker* ww) { return do_io(ww, 1, 0); }
+static int do_seq_read(worker* ww) { return do_io(ww, 0, 0); }
+static int do_rand_write(worker* ww) { return do_io(ww, 1, 1); }
+static int do_rand_read(worker* ww) { return do_io(ww, 0, 1); }
+
+static void*
+run_worker(void* arg)
+{
+    worker* ww = arg;
+    ww->failed = ww->fn(ww) < 0 ? errno : 0;
+    return NULL;
+}
+
+static int
+cmp_long(const void* aa, const void* bb)
+{
+    long xx = *(const long*)aa;
+    long yy = *(const long*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+static double
+percentile_us(long* lat, long count, double pct)
+{
+    long idx = (long)(count * pct / 100.0);
+    idx = idx < count ? idx : count - 1;
+    return lat[idx] / 1e3;
+}
+
+// runs fn on every thread at once, then reports the phase
+static int
+run_phase(const char* name, int (*fn)(worker*), long max_ops)
+{
+    worker ws[threads];
+    for (int tt = 0; tt < threads; ++tt) {
+        memset(&ws[tt], 0, sizeof(worker));
+        ws[tt].id = tt;
+        ws[tt].fn = fn;
+        ws[tt].lat = malloc(max_ops * sizeof(long));
+    }
+    long start = now_ns();
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_create(&ws[tt].thread, NULL, run_worker, &ws[tt]);
+    }
+    for (int tt = 0; tt < threads; ++tt) {
+        pthread_join(ws[tt].thread, NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    long nops = 0;
+    long bytes = 0;
+    int failed = 0;
+    for (int tt = 0; tt < threads; ++tt) {
+        nops += ws[tt].nops;
+        bytes += ws[tt].bytes;
+        failed = failed ? failed : ws[tt].failed;
+    }
+    long* lat = malloc((nops + 1) * sizeof(long));
+    long at = 0;
+    for (int tt = 0; tt < threads; ++tt) {
+        memcpy(lat + at, ws[tt].lat, ws[tt].nops * sizeof(long));
+        at += ws[tt].nops;
+        free(ws[tt].lat);
+    }
+    qsort(lat, nops, sizeof(long), cmp_long);
+
+    if (failed) {
+        fprintf(stderr, "nufs-e2e: %s: %s\n", name, strerror(failed));
+    }
+    printf("{\"phase\": \"%s\", \"threads\": %d, \"ops\": %ld, \"failed\": %s, "
+           "\"seconds\": %.3f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f",
+           name, threads, nops, failed ? "true" : "false", secs, nops / secs,
+           bytes / 1048576.0 / secs);
+    if (nops > 0) {
+        printf(", \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f",
+               percentile_us(lat, nops, 50), percentile_us(lat, nops, 90),
+               percentile_us(lat, nops, 99), percentile_us(lat, nops, 99.9),
+               lat[nops - 1] / 1e3);
+    }
+    printf("}\n");
+    fflush(stdout);
+    free(lat);
+    return failed ? -1 : 0;
+}
+
+static int
+mounted(const char* path)
+{
+    char up[PATH_BYTES];
+    struct stat st, upst;
+    snprintf(up, sizeof(up), "%s/..", path);
+    return stat(path, &st) == 0 && stat(up, &upst) == 0 && st.st_dev != upst.st_dev;
+}
+
+// starts nufs in the foreground and waits until mnt is a different
+// filesystem from its parent, which is when FUSE answers requests
+static pid_t
+start_nufs(const char* nufs, const char* opts, const char* image)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (opts) {
+            execl(nufs, nufs, "-f", "-o", opts, mnt, image, (char*)NULL);
+        }
+        else {
+            execl(nufs, nufs, "-f", mnt, image, (char*)NULL);
+        }
+        perror(nufs);
+        _exit(127);
+    }
+    for (int tries = 0; pid > 0 && tries < 1000; ++tries) {
+        if (mounted(mnt)) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "nufs-e2e: %s didn't mount on %s\n", nufs, mnt);
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+    }
+    return -1;
+}
+
+static void
+stop_nufs(pid_t pid)
+{
+    char cmd[PATH_MAX + 32];
+    snprintf(cmd, sizeof(cmd), "fusermount -u '%s'", mnt);
+    if (system(cmd) != 0) {
+        kill(pid, SIGTERM);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufs-e2e [-t <threads>] [-n <files>] [-d <dirs>] [-f <file MB>]\n"
+                    "                [-s <io size>] [-x <nufs>] [-o <mount options>]"
+                    " <mnt> [<image>]\n");
+    exit(2);
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* nufs = "./nufs";
+    const char* opts = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:d:f:s:x:o:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 'd':
+            dirs = atoi(optarg);
+            break;
+        case 'f':
+            file_bytes = atol(optarg) << 20;
+            break;
+        case 's':
+            io_size = atoi(optarg);
+            break;
+        case 'x':
+            nufs = optarg;
+            break;
+        case 'o':
+            opts = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage();
+    }
+    if (threads < 1 || files < 1 || dirs < 1 || io_size < 1 || file_bytes < io_size) {
+        usage();
+    }
+    if (realpath(argv[optind], mnt) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    pid_t pid = 0;
+    if (optind == argc - 2) {
+        pid = start_nufs(nufs, opts, argv[optind + 1]);
+        if (pid < 0) {
+            return 1;
+        }
+    }
+    else if (!mounted(mnt)) {
+        fprintf(stderr, "nufs-e2e: nothing is mounted on %s\n", mnt);
+        return 1;
+    }
+
+    char path[PATH_BYTES];
+    snprintf(path, sizeof(path), "%s/md", mnt);
+    int rv = mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/io", mnt);
+    rv = rv < 0 ? rv : mkdir(path, 0755);
+    if (rv < 0) {
+        perror(path);
+    }
+
+    long calls = file_bytes / io_size;
+    rv = rv < 0 ? rv : run_phase("mkdir", do_mkdir, dirs + 1);
+    rv = rv < 0 ? rv : run_phase("create", do_create, files);
+    rv = rv < 0 ? rv : run_phase("stat", do_stat, files);
+    rv = rv < 0 ? rv : run_phase("unlink", do_unlink, files);
+    rv = rv < 0 ? rv : run_phase("seq_write", do_seq_write, calls);
+    rv = rv < 0 ? rv : run_phase("seq_read", do_seq_read, calls);
+    rv = rv < 0 ? rv : run_phase("rand_write", do_rand_write, calls);
+    rv = rv < 0 ? rv : run_phase("rand_read", do_rand_read, calls);
+
+    if (pid > 0) {
+        stop_nufs(pid);
+    }
+    return rv < 0 ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+// fsck.nufs: checks an unmounted nufs image
+//
+//   fsck.nufs [-j <threads>] <image>
+//
+// Exits with 0 if the image is clean, 4 if it found errors (it doesn't
+// fix them) and 8 if it couldn't check the image at all.
+//
+// The image is mapped privately, so nothing here writes to it. The checks
+// run as passes over page or inode numbers, each pass split evenly over
+// the threads:
+//   1. every inode, live or in a snapshot, claims the pages it points at
+//   2. every indirect page claims the pages behind it, once no matter how
+//      many inodes share it (that is how the refcounts see it too)
+//   3. every page is checked against its bitmap bit, its refcount and the
+//      claims on it, and allocated pages against their checksums, the
+//      metadata pages too if the image was closed cleanly
+// Then the inode free list is followed, and the directory tree is walked
+// from the root to find inodes nothing reaches and link counts that are
+// off. Directories are small next to the data, so the walk is cheap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "snapshot.h"
+#include "bitmap.h"
+#include "crc32c.h"
+
+typedef void (*fsck_fn)(int ii);
+
+static int fsck_threads = 1;
+static long fsck_errors = 0;
+static pthread_mutex_t fsck_print = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t* claims; // pointers at each page
+static uint8_t*  is_iptr; // pages used as an indirect page
+static uint32_t* links; // directory entries naming each inode
+
+// the inode tables to check: the live one, then each snapshot's
+static inode* tables[SNAP_COUNT + 1];
+static char*  table_bitmaps[SNAP_COUNT + 1];
+static int    ntables = 0;
+
+static void
+fsck_error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&fsck_print);
+    fsck_errors += 1;
+    vprintf(fmt, ap);
+    printf("\n");
+    pthread_mutex_unlock(&fsck_print);
+    va_end(ap);
+}
+
+typedef struct fsck_slice {
+    fsck_fn fn;
+    int     from;
+    int     to;
+} fsck_slice;
+
+static void*
+fsck_worker(void* arg)
+{
+    fsck_slice* slice = arg;
+    for (int ii = slice->from; ii < slice->to; ++ii) {
+        slice->fn(ii);
+    }
+    return NULL;
+}
+
+// calls fn on 0 to count - 1, spread over the threads
+static void
+fsck_pass(fsck_fn fn, int count)
+{
+    pthread_t threads[fsck_threads];
+    fsck_slice slices[fsck_threads];
+    for (int tt = 0; tt < fsck_threads; ++tt) {
+        slices[tt].fn = fn;
+        slices[tt].from = (long)count * tt / fsck_threads;
+        slices[tt].to = (long)count * (tt + 1) / fsck_threads;
+        pthread_create(&threads[tt], NULL, fsck_worker, &slices[tt]);
+    }
+    for (int tt = 0; tt < fsck_threads; ++tt) {
+        pthread_join(threads[tt], NULL);
+    }
+}
+
+static void
+claim(int ptr, const char* what, int num)
+{
+    int pnum = ptr_pnum(ptr);
+    if (pnum == 0) {
+        return;
+    }
+    if (pnum < META_PAGES || pnum >= PAGE_COUNT) {
+        fsck_error("%s %d points at page %d, outside the data pages", what, num, pnum);
+        return;
+    }
+    __atomic_fetch_add(&claims[pnum], 1, __ATOMIC_RELAXED);
+}
+
+// counts the links of each entry in a live directory
+static int
+count_link(dirent* entry, int slot, void* arg)
+{
+    int dnum = *(int*)arg;
+    int child = entry->inum;
+    if (child < 0 || child >= INODE_COUNT || !bitmap_get(get_inode_bitmap(), child)) {
+        fsck_error("directory %d has entry \"%s\" for free inode %d", dnum, entry->name, child);
+        return 0;
+    }
+    if (strcmp(entry->name, "..") != 0) {
+        __atomic_fetch_add(&links[child], 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// pass 1, ii runs over the inodes of every table
+static void
+check_inode(int ii)
+{
+    int tab = ii / INODE_COUNT;
+    int inum = ii % INODE_COUNT;
+    if (!bitmap_get(table_bitmaps[tab], inum)) {
+        return;
+    }
+    inode* node = &tables[tab][inum];
+    const char* what = tab == 0 ? "inode" : "snapshot inode";
+
+    if (node->size < 0 || node->size / PAGE_BYTES >= nptrs + PAGE_BYTES / sizeof(int)) {
+        fsck_error("%s %d has a bad size %ld", what, inum, (long)node->size);
+        return;
+    }
+    for (int pp = 0; pp < nptrs; ++pp) {
+        claim(node->ptrs[pp], what, inum);
+    }
+    if (node->iptr != 0) {
+        claim(node->iptr, what, inum);
+        if (node->iptr > 0 && node->iptr < PAGE_COUNT) {
+            is_iptr[node->iptr] = 1;
+        }
+    }
+
+    // snapshots are frozen, only the live tree has to hang together
+    if (tab != 0 || !S_ISDIR(node->mode)) {
+        return;
+    }
+    int bad = directory_check(node);
+    if (bad > 0) {
+        fsck_error("directory %d has %d damaged pages or entries", inum, bad);
+    }
+    directory_walk(node, 0, count_link, &inum);
+}
+
+// pass 2
+static void
+check_iptr(int pnum)
+{
+    if (!is_iptr[pnum]) {
+        return;
+    }
+    int* iptrs = pages_get_page(pnum);
+    for (int ii = 0; ii < PAGE_BYTES / sizeof(int); ++ii) {
+        claim(iptrs[ii], "indirect page", pnum);
+    }
+}
+
+// pass 3
+static void
+check_page(int pnum)
+{
+    int used = bitmap_get(get_pages_bitmap(), pnum);
+    int refs = get_page_refs()[pnum];
+    int count = claims[pnum];
+
+    if (pnum < META_PAGES) {
+        if (!used) {
+            fsck_error("metadata page %d is free in the bitmap", pnum);
+        }
+        // an image that wasn't closed cleanly has no metadata checksums
+        if (get_super()->meta_csums && page_meta_csummed(pnum)
+            && crc32c(0, pages_get_page(pnum), PAGE_BYTES) != get_page_csums()[pnum]) {
+            fsck_error("metadata page %d doesn't match its checksum", pnum);
+        }
+        return;
+    }
+    if (count > 0 && !used) {
+        fsck_error("page %d is used %d times but free in the bitmap", pnum, count);
+    }
+    else if (count == 0 && used) {
+        fsck_error("page %d is allocated but nothing uses it", pnum);
+    }
+    else if (count > refs) {
+        fsck_error("page %d is used %d times but counts only %d (allocated twice)",
+                   pnum, count, refs);
+    }
+    else if (count < refs) {
+        fsck_error("page %d counts %d references but is used %d times", pnum, refs, count);
+    }
+
+    if (used && crc32c(0, pages_get_page(pnum), PAGE_BYTES) != get_page_csums()[pnum]) {
+        fsck_error("page %d doesn't match its checksum", pnum);
+    }
+}
+
+// follows the inode free list, it has to hold exactly the free inodes
+static void
+check_free_list()
+{
+    nufs_super* sb = get_super();
+    char* seen = calloc(INODE_COUNT, 1);
+    int nfree = 0;
+    for (int inum = 0; inum < INODE_COUNT; ++inum) {
+        nfree += !bitmap_get(get_inode_bitmap(), inum);
+    }
+
+    int count = 0;
+    for (int inum = sb->free_inode; inum != -1; inum = get_inode(inum)->next_free) {
+        if (inum < 0 || inum >= INODE_COUNT || seen[inum]) {
+            fsck_error("the inode free list is broken after %d entries", count);
+            break;
+        }
+        if (bitmap_get(get_inode_bitmap(), inum)) {
+            fsck_error("inode %d is on the free list but in use", inum);
+        }
+        seen[inum] = 1;
+        count += 1;
+    }
+    if (count != nfree || sb->free_inodes != nfree) {
+        fsck_error("%d inodes are free, the free list holds %d and says %d",
+                   nfree, count, sb->free_inodes);
+    }
+    free(seen);
+}
+
+typedef struct tree_walk {
+    int   dnum;
+    char* seen;
+    int*  parent;
+    int*  queue;
+    int   tail;
+} tree_walk;
+
+static int
+walk_entry(dirent* entry, int slot, void* arg)
+{
+    tree_walk* walk = arg;
+    int child = entry->inum;
+    if (child < 0 || child >= INODE_COUNT) {
+        return 0;
+    }
+    if (strcmp(entry->name, "..") == 0) {
+        if (child != walk->parent[walk->dnum]) {
+            fsck_error("directory %d says its parent is %d, not %d",
+                       walk->dnum, child, walk->parent[walk->dnum]);
+        }
+        return 0;
+    }
+    if (walk->seen[child]) {
+        return 0;
+    }
+    walk->seen[child] = 1;
+    walk->parent[child] = walk->dnum;
+    if (S_ISDIR(get_inode(child)->mode)) {
+        walk->queue[walk->tail++] = child;
+    }
+    return 0;
+}
+
+// walks the live tree from the root, checking every inode is reachable,
+// directories know their parent and link counts match the entries
+static void
+check_tree()
+{
+    tree_walk walk;
+    walk.seen = calloc(INODE_COUNT, 1);
+    walk.parent = calloc(INODE_COUNT, sizeof(int));
+    walk.queue = malloc(INODE_COUNT * sizeof(int));
+    walk.tail = 0;
+    walk.seen[0] = 1;
+    walk.queue[walk.tail++] = 0;
+
+    for (int head = 0; head < walk.tail; ++head) {
+        walk.dnum = walk.queue[head];
+        directory_walk(get_inode(walk.dnum), 0, walk_entry, &walk);
+    }
+
+    for (int inum = 1; inum < INODE_COUNT; ++inum) {
+        if (!bitmap_get(get_inode_bitmap(), inum)) {
+            continue;
+        }
+        if (!walk.seen[inum]) {
+            fsck_error("inode %d can't be reached from the root", inum);
+        }
+        else if (get_inode(inum)->refs != links[inum]) {
+            fsck_error("inode %d has %d links but %d entries name it",
+                       inum, get_inode(inum)->refs, links[inum]);
+        }
+    }
+    free(walk.queue);
+    free(walk.parent);
+    free(walk.seen);
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+    fsck_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            fsck_threads = atoi(optarg);
+        }
+        else {
+            fprintf(stderr, "usage: fsck.nufs [-j <threads>] <image>\n");
+            return 8;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: fsck.nufs [-j <threads>] <image>\n");
+        return 8;
+    }
+    fsck_threads = fsck_threads < 1 ? 1 : fsck_threads;
+
+    const char* path = argv[optind];
+    if (pages_open(path, 0) < 0) {
+        fprintf(stderr, "fsck.nufs: %s: not a nufs image\n", path);
+        return 8;
+    }
+    double start = now();
+
+    claims = calloc(PAGE_COUNT, sizeof(uint32_t));
+    is_iptr = calloc(PAGE_COUNT, 1);
+    links = calloc(INODE_COUNT, sizeof(uint32_t));
+
+    tables[0] = get_inode(0);
+    table_bitmaps[0] = get_inode_bitmap();
+    ntables = 1;
+    for (int id = 0; id < SNAP_COUNT; ++id) {
+        snapshot* snap = get_snapshot(id);
+        if (!snap->used) {
+            continue;
+        }
+        for (int ii = 0; ii < snapshot_itab_pages(INODE_COUNT, PAGE_BYTES); ++ii) {
+            claim(snap->itab[ii], "snapshot", id);
+        }
+        tables[ntables] = snapshot_load(id);
+        table_bitmaps[ntables] = snapshot_bitmap(snap);
+        ntables += 1;
+    }
+
+    fsck_pass(check_inode, ntables * INODE_COUNT);
+    fsck_pass(check_iptr, PAGE_COUNT);
+    fsck_pass(check_page, PAGE_COUNT);
+    check_free_list();
+    check_tree();
+
+    printf("%s: %d pages of %d bytes, %d inodes, %d snapshots, %ld errors (%.2fs, %d threads)\n",
+           path, PAGE_COUNT, PAGE_BYTES, INODE_COUNT, ntables - 1, fsck_errors,
+           now() - start, fsck_threads);
+    pages_free();
+    return fsck_errors ? 4 : 0;
+}
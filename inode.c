@@ -7,18 +7,26 @@
 #include "inode.h"
 #include "pages.h"
 #include "bitmap.h"
+#include "util.h"
+#include "log.h"
+#include "trace.h"
 
-/* Definition of the inode structure:
+/* Definition of the inode structure, see inode.h:
 
 typedef struct inode {
-    int refs; // reference count
-    int mode; // permission & type
-    int size; // bytes
-    int ptrs[2]; // direct pointers
-    int iptr; // single indirect pointer
-    time_t atim;
-    time_t ctim;
-    time_t mtim;
+    int32_t  refs; // reference count
+    int32_t  mode; // permission & type
+    int64_t  size; // bytes
+    int64_t  atim; // ns since the epoch
+    int64_t  ctim;
+    int64_t  mtim;
+    uint32_t gen;
+    int32_t  next_free;
+    uint32_t _reserved[4];
+
+    int32_t  ptrs[2]; // direct pointers
+    int32_t  iptr; // single indirect pointer
+    int32_t  _extents[13];
 } inode; */
 
 void 
@@ -26,35 +34,75 @@ print_inode(inode* node) {
     printf("inode located at %p:\n", node);
     printf("Reference count: %d\n", node->refs);
     printf("Node Permission + Type: %d\n", node->mode);
-    printf("Node size in bytes: %d\n", node->size);
+    printf("Node size in bytes: %ld\n", (long)node->size);
     printf("Node direct pointers: %d, %d\n", node->ptrs[0], node->ptrs[1]);
     printf("Node indirect pointer: %d\n", node->iptr);
 }
 
+// timestamps are kept as nanoseconds since the epoch
+int64_t
+inode_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return inode_time(&ts);
+}
+
+int64_t
+inode_time(const struct timespec* ts) {
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+struct timespec
+inode_timespec(int64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    return ts;
+}
+
+static inode* inode_table = 0;
+
 inode* 
 get_inode(int inum) {
-    inode* inodes = get_inode_bitmap() + 32;
+    if (inode_table) {
+        return &inode_table[inum];
+    }
+    inode* inodes = get_inode_table();
     return &inodes[inum];
 }
 
-// take a look at the malloc implementation
+// points get_inode at another copy of the table (a mounted snapshot),
+// or back at the live one when table is NULL
+void
+inode_use_table(inode* table) {
+    inode_table = table;
+}
+
+// takes the inode at the head of the free list, the most recently freed
+// one, so its generation tells it apart from the file it used to be
 int 
 alloc_inode() {
-    int nodenum;
-    for (int ii = 0; ii < 256; ++ii) {
-        if (!bitmap_get(get_inode_bitmap(), ii)) {
-            bitmap_put(get_inode_bitmap(), ii, 1);
-            nodenum = ii;
-            break;
-        }
+    nufs_super* sb = get_super();
+    int nodenum = sb->free_inode;
+    if (nodenum < 0) {
+        return -1;
     }
     inode* new_node = get_inode(nodenum);
+    sb->free_inode = new_node->next_free;
+    sb->free_inodes -= 1;
+    bitmap_put(get_inode_bitmap(), nodenum, 1);
+
     new_node->refs = 1;
     new_node->size = 0;
     new_node->mode = 0;
-    new_node->ptrs[0] = alloc_page();
+    new_node->next_free = -1;
+    // the first page comes with the first write, see inode_write_pnum
+    new_node->ptrs[0] = 0;
+    new_node->ptrs[1] = 0;
+    new_node->iptr = 0;
     
-    time_t curtime = time(NULL);
+    int64_t curtime = inode_now();
+    new_node->gen += 1;
     new_node->ctim = curtime;
     new_node->atim = curtime;
     new_node->mtim = curtime;
@@ -62,49 +110,135 @@ alloc_inode() {
     return nodenum;
 }
 
-// marks the inode as free in the bitmap and then clears the pointer locations
+// marks the inode as free in the bitmap, clears the pointer locations and
+// puts it at the head of the free list
 void 
 free_inode(int inum) {
-    printf("+ free_inode(%d)\n", inum);
+    log_debug("+ free_inode(%d)\n", inum);
+    trace(FREE_INODE, 0, inum, 0);
     inode* node = get_inode(inum);
     void* bmp = get_inode_bitmap(); 
-    shrink_inode(node, 0);
-    free_page(node->ptrs[0]);
+    inode_release(node);
     bitmap_put(bmp, inum, 0);
+
+    nufs_super* sb = get_super();
+    node->next_free = sb->free_inode;
+    sb->free_inode = inum;
+    sb->free_inodes += 1;
 }
 
-// grows the inode, if size gets too big, it allocates a new page if possible
-int grow_inode(inode* node, int size) {
-    for (int i = (node->size / 4096) + 1; i <= size / 4096; i ++) {
-        if (i < nptrs) { //we can use direct ptrs
-            node->ptrs[i] = alloc_page(); //alloc a page
-        } else { //need to use indirect
-            if (node->iptr == 0) { //get a page if we don't have one
-                node->iptr = alloc_page();
-            }
-            int* iptrs = pages_get_page(node->iptr); //retrieve memory loc.
-            iptrs[i - nptrs] = alloc_page(); //add another page
+// drops every page reference the inode holds
+void
+inode_release(inode* node) {
+    shrink_inode(node, 0);
+    free_page(ptr_pnum(node->ptrs[0]));
+    node->ptrs[0] = 0;
+}
+
+// makes sure the indirect page is ours alone before we change it. The
+// copy takes its own reference on every page it points to.
+static int
+inode_own_iptr(inode* node) {
+    if (node->iptr == 0 || page_refs(node->iptr) <= 1) {
+        return 0;
+    }
+    int* iptrs = pages_get_page(node->iptr);
+    int copy = page_cow(node->iptr);
+    if (copy < 0) {
+        return -1;
+    }
+    for (int i = nptrs; i <= node->size / PAGE_BYTES; i ++) {
+        page_ref(ptr_pnum(iptrs[i - nptrs]));
+    }
+    node->iptr = copy;
+    return 0;
+}
+
+// gets the page number of the pidx'th page of the file
+int
+inode_get_ptr(inode* node, int pidx) {
+    if (pidx < nptrs) {
+        return node->ptrs[pidx];
+    }
+    // past what the indirect page points to there is nothing
+    if (node->iptr == 0 || pidx - nptrs >= PAGE_BYTES / sizeof(int)) {
+        return 0;
+    }
+    int* iptrs = pages_get_page(node->iptr);
+    return iptrs[pidx - nptrs];
+}
+
+// points the pidx'th page of the file at pnum, the caller hands over its
+// reference to pnum and takes care of whatever was there before
+int
+inode_set_ptr(inode* node, int pidx, int pnum) {
+    if (pidx < nptrs) {
+        node->ptrs[pidx] = pnum;
+        return 0;
+    }
+    // the file can't grow past what one indirect page points to
+    if (pidx - nptrs >= PAGE_BYTES / sizeof(int)) {
+        return -1;
+    }
+    if (node->iptr == 0) { //get a page if we don't have one
+        node->iptr = alloc_page();
+        if (node->iptr < 0) {
+            node->iptr = 0;
+            return -1;
         }
     }
+    else if (inode_own_iptr(node) < 0) {
+        return -1;
+    }
+    int* iptrs = pages_get_page(node->iptr); //retrieve memory loc.
+    iptrs[pidx - nptrs] = pnum;
+    page_written(node->iptr);
+    return 0;
+}
+
+// grows the inode to size. The new pages are left as holes that read as
+// zeros, inode_write_pnum allocates each one when it is first written.
+int grow_inode(inode* node, int64_t size) {
+    // the file can't grow past what one indirect page points to
+    if (size / PAGE_BYTES >= INODE_MAX_PAGES) {
+        return -1;
+    }
     node->size = size;
     return 0;
 }
 
 // shrinks an inode size and deallocates pages if we've freed them up
-int shrink_inode(inode* node, int size) {
-    for (int i = (node->size / 4096); i > size / 4096; i --) {
+int shrink_inode(inode* node, int64_t size) {
+    int last = node->size / PAGE_BYTES;
+    // an indirect page shared with a snapshot or a clone is dropped whole
+    // rather than copied just to be emptied
+    if (size / PAGE_BYTES < nptrs && node->iptr != 0 && page_refs(node->iptr) > 1) {
+        free_page(node->iptr);
+        node->iptr = 0;
+        last = min(last, nptrs - 1);
+    }
+    for (int i = last; i > size / PAGE_BYTES; i --) {
         if (i < nptrs) { //we're in direct ptrs
-            free_page(node->ptrs[i]); //free the page
+            free_page(ptr_pnum(node->ptrs[i])); //free the page
             node->ptrs[i] = 0;
-        } else { //need to use indirect
+        } else if (node->iptr != 0) { //need to use indirect, if the file got that far
+            if (inode_own_iptr(node) < 0) {
+                return -1;
+            }
             int* iptrs = pages_get_page(node->iptr); //retrieve memory loc.
-            free_page(iptrs[i - nptrs]); //free the single page
+            free_page(ptr_pnum(iptrs[i - nptrs])); //free the single page
             iptrs[i-nptrs] = 0;
 
             if (i == nptrs) { //if that was the last thing on the page
                 free_page(node->iptr); //we don't need it anymore
                 node->iptr = 0;
             }
+            else {
+                page_written(node->iptr);
+            }
+        }
+        if (node->size > (int64_t)i * PAGE_BYTES) {
+            node->size = (int64_t)i * PAGE_BYTES;
         }
     } 
     node->size = size;
@@ -112,14 +246,109 @@ int shrink_inode(inode* node, int size) {
 }
 
 // gets the page number for the inode
-int inode_get_pnum(inode* node, int fpn) {
-    int blocknum = fpn / 4096;
-    if (blocknum < nptrs) {
-        return node->ptrs[blocknum];
-    } else {
-        int* iptrs = pages_get_page(node->iptr);
-        return iptrs[blocknum-nptrs];
+int inode_get_pnum(inode* node, int64_t fpn) {
+    if (fpn / PAGE_BYTES >= INODE_MAX_PAGES) {
+        return 0;
+    }
+    return inode_get_ptr(node, fpn / PAGE_BYTES);
+}
+
+// gets the page number for writing at byte fpn, copying the page first
+// if a snapshot or a clone still shares it
+int inode_write_pnum(inode* node, int64_t fpn) {
+    if (fpn / PAGE_BYTES >= INODE_MAX_PAGES) {
+        return -1;
+    }
+    int pidx = fpn / PAGE_BYTES;
+    // pages behind a shared indirect page are shared too, even though
+    // only the indirect page counts the extra reference
+    if (pidx >= nptrs && inode_own_iptr(node) < 0) {
+        return -1;
+    }
+    int pnum = inode_get_ptr(node, pidx);
+    if (pnum == 0) {
+        // pages are only allocated once something is written to them
+        pnum = alloc_page();
+        if (pnum < 0 || inode_set_ptr(node, pidx, pnum) < 0) {
+            free_page(pnum);
+            return -1;
+        }
+        return pnum;
+    }
+    if (page_refs(pnum) <= 1) {
+        return pnum;
+    }
+    int copy = page_cow(pnum);
+    if (copy < 0) {
+        return -1;
+    }
+    if (inode_set_ptr(node, pidx, copy) < 0) {
+        // put the shared page back, the copy goes unused
+        page_ref(pnum);
+        free_page(copy);
+        return -1;
+    }
+    return copy;
+}
+
+// makes dst share all of src's pages. Only the direct pointers and the
+// indirect page gain a reference, so this is cheap for any file size.
+// Returns -1, leaving dst alone, if one of those is shared too widely.
+int
+inode_clone(inode* src, inode* dst) {
+    for (int ii = 0; ii < nptrs; ++ii) {
+        if (page_refs(ptr_pnum(src->ptrs[ii])) >= PAGE_REFS_SHARE) {
+            return -1;
+        }
+    }
+    if (page_refs(src->iptr) >= PAGE_REFS_SHARE) {
+        return -1;
+    }
+    inode_release(dst);
+    for (int ii = 0; ii < nptrs; ++ii) {
+        dst->ptrs[ii] = src->ptrs[ii];
+        page_ref(ptr_pnum(dst->ptrs[ii]));
+    }
+    dst->iptr = src->iptr;
+    page_ref(dst->iptr);
+    dst->size = src->size;
+    return 0;
+}
+
+// shares count pages of src starting at page sidx as dst's pages starting
+// at didx. Pages dst already had there are released. Compressed clusters
+// in either range have to be expanded first.
+int
+inode_clone_range(inode* src, int sidx, inode* dst, int didx, int count) {
+    if (dst->size < (int64_t)didx * PAGE_BYTES && grow_inode(dst, (int64_t)didx * PAGE_BYTES) < 0) {
+        return -1;
     }
+    for (int ii = 0; ii < count; ++ii) {
+        int pnum = inode_get_ptr(src, sidx + ii);
+        int old = 0;
+        if (didx + ii <= dst->size / PAGE_BYTES) {
+            old = inode_get_ptr(dst, didx + ii);
+        }
+        if (pnum != 0 && page_refs(pnum) >= PAGE_REFS_SHARE) {
+            // shared too widely already, dst gets a copy
+            pnum = page_dup(pnum);
+            if (pnum < 0) {
+                return -1;
+            }
+        }
+        else {
+            page_ref(pnum);
+        }
+        if (inode_set_ptr(dst, didx + ii, pnum) < 0) {
+            free_page(pnum);
+            return -1;
+        }
+        free_page(old);
+        if (dst->size < (int64_t)(didx + ii) * PAGE_BYTES) {
+            dst->size = (int64_t)(didx + ii) * PAGE_BYTES;
+        }
+    }
+    return 0;
 }
 
 void decrease_refs(int inum)
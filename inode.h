@@ -4,28 +4,58 @@
 #define INODE_H
 
 #include "pages.h"
+#include <stdint.h>
 #include <time.h>
 
 #define nptrs 2
+// pages a file can have, the direct ones and what the indirect page holds
+#define INODE_MAX_PAGES (nptrs + PAGE_BYTES / (int)sizeof(int))
 
+// flag bits kept in mode above the file type
+#define INODE_FLAGS    0x7f000000
+#define INODE_COMPRESS 0x01000000 // compress the file's data, see compress.c
+#define INODE_PACKED   0x02000000 // directory entries are packed, see directory.c
+
+// page pointer bit marking a page of a compressed cluster
+#define PTR_Z 0x40000000
+#define ptr_pnum(ptr) ((ptr) & ~PTR_Z)
+
+// 128 bytes on two cache lines, everything stat needs is in the first
 typedef struct inode {
-    int refs; // reference count
-    int mode; // permission & type
-    int size; // bytes
-    int ptrs[nptrs]; // direct pointers
-    int iptr; // single indirect pointer
-    time_t atim; // time last accessed
-    time_t ctim; // time created
-    time_t mtim; // time last modified
-} inode;
+    int32_t  refs; // reference count
+    int32_t  mode; // permission & type
+    int64_t  size; // bytes
+    int64_t  atim; // time last accessed, ns since the epoch
+    int64_t  ctim; // time created
+    int64_t  mtim; // time last modified
+    uint32_t gen;  // bumped each time the inode number is handed out
+    int32_t  next_free; // while free, the next one on the free list or -1
+    uint32_t _reserved[4];
+
+    int32_t  ptrs[nptrs]; // direct pointers
+    int32_t  iptr; // single indirect pointer
+    int32_t  _extents[13]; // room for inline extents
+} __attribute__((aligned(64))) inode;
+
+_Static_assert(sizeof(inode) == 128, "inode records are two cache lines");
 
 void print_inode(inode* node);
+int64_t inode_now();
+int64_t inode_time(const struct timespec* ts);
+struct timespec inode_timespec(int64_t ns);
 inode* get_inode(int inum);
+void inode_use_table(inode* table);
 int alloc_inode();
 void free_inode(int inum);
-int grow_inode(inode* node, int size);
-int shrink_inode(inode* node, int size);
-int inode_get_pnum(inode* node, int fpn);
+void inode_release(inode* node);
+int grow_inode(inode* node, int64_t size);
+int shrink_inode(inode* node, int64_t size);
+int inode_get_ptr(inode* node, int pidx);
+int inode_set_ptr(inode* node, int pidx, int pnum);
+int inode_get_pnum(inode* node, int64_t fpn);
+int inode_write_pnum(inode* node, int64_t fpn);
+int inode_clone(inode* src, inode* dst);
+int inode_clone_range(inode* src, int sidx, inode* dst, int didx, int count);
 void decrease_refs(int inum);
 
 #endif
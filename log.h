@@ -0,0 +1,32 @@
+// compile-time log levels
+//
+// Messages above NUFS_LOG_LEVEL compile to nothing, the arguments are
+// still type checked but never evaluated. The Makefile builds with
+// LOG=2 (info), make LOG=3 brings back a line for every call.
+
+#ifndef NUFS_LOG_H
+#define NUFS_LOG_H
+
+#include <stdio.h>
+
+#define LOG_NONE  0
+#define LOG_ERROR 1 // something is wrong with the image
+#define LOG_INFO  2 // rare events: mounts, snapshots, passes
+#define LOG_DEBUG 3 // every callback and page operation
+
+#ifndef NUFS_LOG_LEVEL
+#define NUFS_LOG_LEVEL LOG_INFO
+#endif
+
+#define log_at(level, out, ...)             \
+    do {                                    \
+        if ((level) <= NUFS_LOG_LEVEL) {    \
+            fprintf(out, __VA_ARGS__);      \
+        }                                   \
+    } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, stderr, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, stdout, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, stdout, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,127 @@
+// mkfs.nufs: makes an empty nufs image
+//
+//   mkfs.nufs [-b <page size>] [-p <pages>] [-i <inodes>] [-s <stripe size>]
+//             <image>[:<image>...]
+//   mkfs.nufs -u <image>
+//
+// Pages are 4096 bytes unless -b says otherwise (a power of two up to
+// 65536). Bigger pages suit big files read and written in long runs, the
+// default suits lots of small files and directories. -p 262144 makes a
+// 1GB image of 4k pages. The inode count defaults to one per page. Both
+// counts are rounded up to a multiple of 8.
+//
+// Given several files, separated by ':', the image is striped across
+// them like RAID-0: -s bytes (1MB by default, a multiple of the page
+// size) go in the first file, the next -s in the second and so on. Put
+// them on different disks. nufs and fsck.nufs take the same list.
+//
+// -u converts an image made by an older nufs, files, snapshots and all,
+// keeping the original as <image>.old. See upgrade.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "upgrade.h"
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: mkfs.nufs [-b <page size>] [-p <pages>] [-i <inodes>] "
+                    "[-s <stripe size>] <image>[:<image>...]\n"
+                    "       mkfs.nufs -u <image>\n");
+    exit(2);
+}
+
+int
+main(int argc, char* argv[])
+{
+    long page_size = 4096;
+    long page_count = 256;
+    long inode_count = 0;
+    long stripe = 0;
+    int upgrade = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:i:s:u")) != -1) {
+        switch (opt) {
+        case 'b':
+            page_size = atol(optarg);
+            break;
+        case 'p':
+            page_count = atol(optarg);
+            break;
+        case 'i':
+            inode_count = atol(optarg);
+            break;
+        case 's':
+            stripe = atol(optarg);
+            break;
+        case 'u':
+            upgrade = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    const char* path = argv[optind];
+
+    if (upgrade) {
+        int rv = upgrade_image(path);
+        if (rv < 0) {
+            fprintf(stderr, "mkfs.nufs: %s: not an image from an older nufs: %s\n",
+                    path, strerror(-rv));
+            return 1;
+        }
+        if (rv == 0) {
+            printf("%s: already current\n", path);
+        }
+        else {
+            printf("%s: upgraded, the old image is %s.old\n", path, path);
+        }
+        return 0;
+    }
+
+    if (inode_count == 0) {
+        inode_count = page_count;
+    }
+    page_count = (page_count + 7) / 8 * 8;
+    inode_count = (inode_count + 7) / 8 * 8;
+    // page numbers share their int with the PTR_Z bit
+    if (page_count < 8 || page_count >= PTR_Z || inode_count < 8 || inode_count > page_count) {
+        fprintf(stderr, "mkfs.nufs: need 8 <= inodes <= pages < %d\n", PTR_Z);
+        return 1;
+    }
+
+    if (page_size < MIN_PAGE_BYTES || page_size > MAX_PAGE_BYTES
+        || (page_size & (page_size - 1)) != 0) {
+        fprintf(stderr, "mkfs.nufs: the page size is a power of two from %d to %d\n",
+                MIN_PAGE_BYTES, MAX_PAGE_BYTES);
+        return 1;
+    }
+
+    if (stripe < 0 || stripe % page_size != 0 || stripe > (1L << 30)) {
+        fprintf(stderr, "mkfs.nufs: the stripe size is a multiple of the page size\n");
+        return 1;
+    }
+
+    int rv = pages_format(path, page_size, page_count, inode_count, stripe);
+    if (rv == 0) {
+        rv = pages_open(path, 1);
+    }
+    if (rv < 0) {
+        fprintf(stderr, "mkfs.nufs: %s: can't make an image of that size\n", path);
+        return 1;
+    }
+    directory_init();
+    printf("%s: %d pages of %d bytes, %d inodes, %d pages of metadata\n",
+           path, PAGE_COUNT, PAGE_BYTES, INODE_COUNT, META_PAGES);
+    pages_free();
+    return 0;
+}
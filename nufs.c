@@ -1,5 +1,6 @@
 // based on cs3650 starter code
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,19 +10,98 @@
 #include <dirent.h>
 #include <bsd/string.h>
 #include <assert.h>
+#include <stddef.h>
+#include <linux/fs.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <fnmatch.h>
 #include "storage.h"
 #include "inode.h"
+#include "nufs_ioctl.h"
+#include "scrub.h"
+#include "log.h"
+#include "trace.h"
+#include "stats.h"
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+// nufs specific mount options, passed as -o name=value
+typedef struct nufs_config {
+    int snapshot; // id of the snapshot to mount read-only, or -1
+    int dedup;    // share identical pages as they are written
+    int scrub;    // pages and inodes per second to verify, 0 for none
+    char* trace;  // file the trace ring is dumped to, tracing is off if NULL
+    char* record; // file every call is recorded to, or NULL
+    int cache;    // seconds the kernel keeps names and attributes, 0 for none
+    int atime;    // a STORAGE_*ATIME
+    int lazytime; // keep timestamp-only changes in memory until fsync
+    char* direct; // files whose paths match this are opened with direct_io
+} nufs_config;
+
+static nufs_config config = { -1, 0, 0, NULL, NULL, 0, STORAGE_RELATIME, 0, NULL };
+
+static struct fuse_opt nufs_opts[] = {
+    { "snapshot=%d", offsetof(nufs_config, snapshot), 0 },
+    { "dedup", offsetof(nufs_config, dedup), 1 },
+    { "scrub", offsetof(nufs_config, scrub), 64 },
+    { "scrub=%d", offsetof(nufs_config, scrub), 0 },
+    { "trace=%s", offsetof(nufs_config, trace), 0 },
+    { "record=%s", offsetof(nufs_config, record), 0 },
+    { "cache=%d", offsetof(nufs_config, cache), 0 },
+    { "strictatime", offsetof(nufs_config, atime), STORAGE_STRICTATIME },
+    { "relatime", offsetof(nufs_config, atime), STORAGE_RELATIME },
+    { "noatime", offsetof(nufs_config, atime), STORAGE_NOATIME },
+    { "lazytime", offsetof(nufs_config, lazytime), 1 },
+    { "direct=%s", offsetof(nufs_config, direct), 0 },
+    FUSE_OPT_END
+};
+
+// a read-only file of counters and latencies at the root, it isn't
+// listed by readdir and can't be made, removed or renamed
+#define STATS_PATH "/.nufs-stats"
+#define STATS_BYTES 8192
+
+static int
+is_stats(const char* path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+// the largest read or write we ask the kernel for
+#define MAX_IO (1 << 20)
+
+// fi->fh of a file opened with direct_io, whose pages we don't keep
+// either once they have been read or written
+#define DIRECT_FH 1
+
+// accounts for a finished callback in the stats and, while recording,
+// appends it to the recording. Callbacks that reach the storage layer
+// call it before they let go of the storage lock, so the recording has
+// their calls in the order they ran.
+static void
+op_done(int op, uint64_t start, int rv, long bytes, const char* path, const char* path2,
+        int arg, off_t off)
+{
+    stats_op(op, start, rv, bytes);
+    if (record_file) {
+        record_put(op, start, rv, path, path2, arg, off, 0);
+    }
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int
 nufs_access(const char *path, int mask)
 {
+    uint64_t start = stats_now();
     int rv = 0;
-    rv = storage_access(path);
-    printf("access(%s, %04o) -> %d\n", path, mask, rv);
+    storage_lock();
+    rv = is_stats(path) ? 0 : storage_access(path);
+    log_debug("access(%s, %04o) -> %d\n", path, mask, rv);
+    trace(ACCESS, rv, mask, 0);
+    op_done(NUFS_OP_access, start, rv, 0, path, NULL, mask, 0);
+    storage_unlock();
     return rv;
 }
 
@@ -30,7 +110,9 @@ nufs_access(const char *path, int mask)
 int
 nufs_getattr(const char *path, struct stat *st)
 {
+    uint64_t start = stats_now();
     int rv = 0;
+    storage_lock();
     if (strcmp(path, "/") == 0) {
     // we DO want this root case because it is a special case
         st->st_mode = 040755; // directory
@@ -38,54 +120,38 @@ nufs_getattr(const char *path, struct stat *st)
         st->st_uid = getuid();
         st->st_nlink = 1;
     }
+    else if (is_stats(path)) {
+        // the size isn't known until it is opened, see nufs_open
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = 0100444;
+        st->st_uid = getuid();
+        st->st_nlink = 1;
+    }
     else {
         rv = storage_stat(path, st);
         st->st_uid = getuid();
     }
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
-    if (rv == -1)
-        return -ENOENT;
-    return 0;
+    log_debug("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
+    trace(GETATTR, rv, st->st_mode, st->st_size);
+    op_done(NUFS_OP_getattr, start, rv, 0, path, NULL, 0, 0);
+    storage_unlock();
+    return rv;
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, picking up at the cookie in offset
 int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
-    struct stat st;
-    int rv;
-
-    rv = nufs_getattr(path, &st);
-    assert(rv == 0);
-
-    slist* dirnames = storage_list(path);
-    filler(buf, ".", &st, 0);
-    if (dirnames == NULL) {
-        printf("readdir(%s) -> %d\n", path, rv);
-        return 0;
-    }
-
-    slist* currname = dirnames;
-    while(currname != NULL) {
-        char currpath[strlen(path) + 50];
-        strncpy(currpath, path, strlen(path));
-	if (path[strlen(path)-1] == '/') {
-	    currpath[strlen(path)] = 0;
-	} else {
- 	    currpath[strlen(path)] = '/';
-	    currpath[strlen(path) + 1] = 0;
-	}
-        strncat(currpath, currname->data, 48);
-        nufs_getattr(currpath, &st);
-        filler(buf, currname->data, &st, 0);
-        currname = currname->next;
-    }
-
-    printf("readdir(%s) -> %d\n", path, rv);
-    s_free(dirnames);
-    return 0;
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = storage_readdir(path, offset, filler, buf);
+    log_debug("readdir(%s, %ld) -> %d\n", path, (long)offset, rv);
+    trace(READDIR, rv, 0, offset);
+    op_done(NUFS_OP_readdir, start, rv, 0, path, NULL, 0, offset);
+    storage_unlock();
+    return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -93,9 +159,13 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    int rv = -1;
-    rv = storage_mknod(path, mode);
-    printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = is_stats(path) ? -EEXIST : storage_mknod(path, mode);
+    log_debug("mknod(%s, %04o) -> %d\n", path, mode, rv);
+    trace(MKNOD, rv, mode, 0);
+    op_done(NUFS_OP_mknod, start, rv, 0, path, NULL, mode, 0);
+    storage_unlock();
     return rv;
 }
 
@@ -104,34 +174,51 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
-    int rv = nufs_mknod(path, mode | 040000, 0);
-    printf("mkdir(%s) -> %d\n", path, rv);
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = is_stats(path) ? -EEXIST : storage_mknod(path, mode | 040000);
+    log_debug("mkdir(%s) -> %d\n", path, rv);
+    trace(MKDIR, rv, mode, 0);
+    op_done(NUFS_OP_mkdir, start, rv, 0, path, NULL, mode, 0);
+    storage_unlock();
     return rv;
 }
 
 int
 nufs_unlink(const char *path)
 {
-    int rv = -1;
-    rv = storage_unlink(path);
-    printf("unlink(%s) -> %d\n", path, rv);
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = is_stats(path) ? -EPERM : storage_unlink(path);
+    log_debug("unlink(%s) -> %d\n", path, rv);
+    trace(UNLINK, rv, 0, 0);
+    op_done(NUFS_OP_unlink, start, rv, 0, path, NULL, 0, 0);
+    storage_unlock();
     return rv;
 }
 
 int
 nufs_link(const char *from, const char *to)
 {
+    uint64_t start = stats_now();
     int rv = -1;
-    printf("link(%s => %s) -> %d\n", from, to, rv);
+    storage_lock();
     rv = storage_link(to, from);
+    log_debug("link(%s => %s) -> %d\n", from, to, rv);
+    trace(LINK, rv, 0, 0);
+    op_done(NUFS_OP_link, start, rv, 0, from, to, 0, 0);
+    storage_unlock();
     return rv;
 }
 
 int
 nufs_rmdir(const char *path)
 {
+    uint64_t start = stats_now();
     int rv = -1;
-    printf("rmdir(%s) -> %d\n", path, rv);
+    log_debug("rmdir(%s) -> %d\n", path, rv);
+    trace(RMDIR, rv, 0, 0);
+    op_done(NUFS_OP_rmdir, start, rv, 0, path, NULL, 0, 0);
     return rv;
 }
 
@@ -140,47 +227,130 @@ nufs_rmdir(const char *path)
 int
 nufs_rename(const char *from, const char *to)
 {
-    int rv = -1;
-    rv = storage_rename(from, to);
-    printf("rename(%s => %s) -> %d\n", from, to, rv);
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = is_stats(from) || is_stats(to) ? -EPERM : storage_rename(from, to);
+    log_debug("rename(%s => %s) -> %d\n", from, to, rv);
+    trace(RENAME, rv, 0, 0);
+    op_done(NUFS_OP_rename, start, rv, 0, from, to, 0, 0);
+    storage_unlock();
     return rv;
 }
 
 int
 nufs_chmod(const char *path, mode_t mode)
 {
+    uint64_t start = stats_now();
     int rv = -1;
-    printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    log_debug("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    trace(CHMOD, rv, mode, 0);
+    op_done(NUFS_OP_chmod, start, rv, 0, path, NULL, mode, 0);
     return rv;
 }
 
 int
 nufs_truncate(const char *path, off_t size)
 {
-    int rv = -1;
-    rv = storage_truncate(path, size);
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = is_stats(path) ? -EACCES : storage_truncate(path, size);
+    log_debug("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    trace(TRUNCATE, rv, 0, size);
+    op_done(NUFS_OP_truncate, start, rv, 0, path, NULL, 0, size);
+    storage_unlock();
     return rv;
 }
 
+// renders the stats for one open of the stats file, its reads copy from
+// the text in fi->fh
+static int
+open_stats(struct fuse_file_info* fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    char* text = malloc(STATS_BYTES);
+    if (text == NULL) {
+        return -ENOMEM;
+    }
+    storage_lock();
+    stats_render(text, STATS_BYTES);
+    storage_unlock();
+    fi->fh = (uint64_t)text;
+    fi->direct_io = 1;
+    return 0;
+}
+
 // this is called on open, but doesn't need to do much
 // since FUSE doesn't assume you maintain state for
-// open files.
+// open files. The stats file is the exception: it is rendered once per
+// open, so every read of one open sees the same numbers, and read
+// directly since its size isn't known to getattr. Files opened with
+// O_DIRECT or matching -o direct=<pattern> skip the kernel's cache.
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_now();
     int rv = 0;
-    printf("open(%s) -> %d\n", path, rv);
+    if (is_stats(path)) {
+        rv = open_stats(fi);
+    }
+    else if ((fi->flags & O_DIRECT)
+             || (config.direct && fnmatch(config.direct, path, 0) == 0)) {
+        fi->direct_io = 1;
+        fi->fh = DIRECT_FH;
+    }
+    log_debug("open(%s) -> %d\n", path, rv);
+    trace(OPEN, rv, 0, 0);
+    op_done(NUFS_OP_open, start, rv, 0, path, NULL, fi->flags, 0);
     return rv;
 }
 
+// called when the last descriptor of an open file is closed, the point
+// at which files marked for compression get compressed
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    uint64_t start = stats_now();
+    int rv = 0;
+    storage_lock();
+    if (is_stats(path)) {
+        free((char*)fi->fh);
+    }
+    else {
+        rv = storage_compress(path);
+    }
+    log_debug("release(%s) -> %d\n", path, rv);
+    trace(RELEASE, rv, 0, 0);
+    op_done(NUFS_OP_release, start, rv, 0, path, NULL, 0, 0);
+    storage_unlock();
+    return 0;
+}
+
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_now();
     int rv = -1;
-    rv = storage_read(path, buf, size, offset);
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    storage_lock();
+    if (is_stats(path)) {
+        const char* text = (const char*)fi->fh;
+        int len = strlen(text);
+        rv = offset < len ? len - offset : 0;
+        rv = rv < size ? rv : size;
+        memcpy(buf, text + offset, rv);
+    }
+    else {
+        rv = storage_read(path, buf, size, offset);
+        if (rv > 0 && fi->fh == DIRECT_FH) {
+            storage_forget(path, offset, rv);
+        }
+    }
+    log_debug("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    trace(READ, rv, size, offset);
+    op_done(NUFS_OP_read, start, rv, rv, path, NULL, size, offset);
+    storage_unlock();
     return rv;
 }
 
@@ -188,9 +358,17 @@ nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t start = stats_now();
     int rv = -1;
+    storage_lock();
     rv = storage_write(path, buf, size, offset);
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    if (rv > 0 && fi->fh == DIRECT_FH) {
+        storage_forget(path, offset, rv);
+    }
+    log_debug("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    trace(WRITE, rv, size, offset);
+    op_done(NUFS_OP_write, start, rv, rv, path, NULL, size, offset);
+    storage_unlock();
     return rv;
 }
 
@@ -198,37 +376,224 @@ nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct
 int
 nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    uint64_t start = stats_now();
     int rv = -1;
+    storage_lock();
     rv = storage_set_time(path, ts);
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
+    log_debug("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+    trace(UTIMENS, rv, 0, 0);
+    // op_done but with both times, so a replay sets the same ones
+    stats_op(NUFS_OP_utimens, start, rv, 0);
+    if (record_file) {
+        record_put(NUFS_OP_utimens, start, rv, path, NULL, 0,
+                   record_time(&ts[0]), record_time(&ts[1]));
+    }
+    storage_unlock();
     return rv;
 }
 
 // Extended operations
+// splits the names of a bulk request, returns count or -EINVAL if they
+// don't fit the buffer
+static int
+bulk_names(const char* buf, int count, const char** names)
+{
+    if (count < 0 || count > NUFS_BULK_COUNT) {
+        return -EINVAL;
+    }
+    int off = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        int len = strnlen(buf + off, NUFS_BULK_NAMES - off);
+        if (off + len >= NUFS_BULK_NAMES) {
+            return -EINVAL;
+        }
+        names[ii] = buf + off;
+        off += len + 1;
+    }
+    return count;
+}
+
 int
 nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
+    uint64_t start = stats_now();
     int rv = 0;
-    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    storage_lock();
+    switch (cmd) {
+    case NUFS_IOC_SNAP_CREATE:
+        rv = storage_snapshot_create();
+        break;
+    case NUFS_IOC_SNAP_DELETE:
+        rv = storage_snapshot_delete(*(int*)data);
+        break;
+    case NUFS_IOC_SNAP_LIST:
+        rv = storage_snapshot_list(((nufs_snap_list*)data)->ctim, NUFS_SNAP_MAX);
+        break;
+    case NUFS_IOC_CLONE:
+        rv = storage_clone((char*)data, path, 0, 0, 0);
+        break;
+    case NUFS_IOC_CLONE_RANGE: {
+        nufs_clone_range* range = data;
+        rv = storage_clone(range->src, path, range->src_offset,
+                           range->src_length, range->dest_offset);
+        break;
+    }
+    case FS_IOC_GETFLAGS:
+        // chattr/lsattr, compression is the only attribute we know
+        rv = storage_get_flags(path);
+        if (rv >= 0) {
+            *(long*)data = (rv & INODE_COMPRESS) ? FS_COMPR_FL : 0;
+            rv = 0;
+        }
+        break;
+    case FS_IOC_SETFLAGS:
+        rv = storage_set_flags(path, (*(long*)data & FS_COMPR_FL) ? INODE_COMPRESS : 0);
+        break;
+    case FS_IOC_GETVERSION:
+        rv = storage_get_version(path, (long*)data);
+        break;
+    case NUFS_IOC_DEDUP:
+        rv = storage_dedup_all();
+        break;
+    case NUFS_IOC_DEDUP_STATS: {
+        nufs_dedup_stats* stats = data;
+        rv = storage_dedup_stats(&stats->pages_written, &stats->pages_shared,
+                                 &stats->hash_ns, &stats->lookup_ns);
+        break;
+    }
+    case NUFS_IOC_CSUM_ERRORS:
+        *(long*)data = storage_csum_errors();
+        break;
+    case NUFS_IOC_SCRUB_STATS: {
+        scrub_stats stats;
+        scrub_get_stats(&stats);
+        nufs_scrub_stats* out = data;
+        out->passes = stats.passes;
+        out->pages_checked = stats.pages_checked;
+        out->inodes_checked = stats.inodes_checked;
+        out->errors = stats.errors;
+        out->cursor = stats.cursor;
+        out->total = stats.total;
+        break;
+    }
+    case NUFS_IOC_BULK_CREATE: {
+        nufs_bulk_create* req = data;
+        const char* names[NUFS_BULK_COUNT];
+        rv = bulk_names(req->names, req->count, names);
+        if (rv >= 0) {
+            rv = storage_bulk_create(path, names, req->count, req->mode, req->results);
+        }
+        break;
+    }
+    case NUFS_IOC_BULK_STAT: {
+        nufs_bulk_stat* req = data;
+        const char* names[NUFS_BULK_COUNT];
+        struct stat sts[NUFS_BULK_COUNT];
+        int results[NUFS_BULK_COUNT];
+        rv = bulk_names(req->names, req->count, names);
+        if (rv >= 0) {
+            rv = storage_bulk_stat(path, names, req->count, sts, results);
+        }
+        for (int ii = 0; rv >= 0 && ii < req->count; ++ii) {
+            nufs_stat* out = &req->stats[ii];
+            memset(out, 0, sizeof(nufs_stat));
+            out->result = results[ii];
+            if (results[ii] < 0) {
+                continue;
+            }
+            out->size = sts[ii].st_size;
+            out->atim = inode_time(&sts[ii].st_atim);
+            out->mtim = inode_time(&sts[ii].st_mtim);
+            out->ctim = inode_time(&sts[ii].st_ctim);
+            out->mode = sts[ii].st_mode;
+            out->nlink = sts[ii].st_nlink;
+        }
+        break;
+    }
+    case NUFS_IOC_STATS:
+        stats_get(data);
+        break;
+    case NUFS_IOC_TRACE_DUMP:
+        record_flush();
+        rv = trace_dump();
+        break;
+    default:
+        rv = -ENOTTY;
+    }
+    log_debug("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    trace(IOCTL, rv, cmd, 0);
+    op_done(NUFS_OP_ioctl, start, rv, 0, path, NULL, cmd, 0);
+    storage_unlock();
     return rv;
 }
 
 int nufs_symlink(const char* to, const char* from) {
+    uint64_t start = stats_now();
     int rv = -1;
+    storage_lock();
     rv = storage_symlink(to, from);
-    printf("symlink(%s, %s) -> %d\n", to, from, rv);
+    log_debug("symlink(%s, %s) -> %d\n", to, from, rv);
+    trace(SYMLINK, rv, 0, 0);
+    op_done(NUFS_OP_symlink, start, rv, 0, to, from, 0, 0);
+    storage_unlock();
     return rv;
 }
 
 int nufs_readlink(const char* path, char* buf, size_t size) {
+    uint64_t start = stats_now();
     int rv = -1;
+    storage_lock();
     rv = storage_readlink(path, buf, size);
-    printf("readlink(%s, %ld) -> %d\n", path, size, rv);
+    log_debug("readlink(%s, %ld) -> %d\n", path, size, rv);
+    trace(READLINK, rv, size, 0);
+    op_done(NUFS_OP_readlink, start, rv, 0, path, NULL, size, 0);
+    storage_unlock();
+    return rv;
+}
+
+// writes the whole image back, with the times lazytime held on to
+int
+nufs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t start = stats_now();
+    storage_lock();
+    int rv = storage_sync();
+    log_debug("fsync(%s, %d) -> %d\n", path, datasync, rv);
+    trace(FSYNC, rv, datasync, 0);
+    op_done(NUFS_OP_fsync, start, rv, 0, path, NULL, datasync, 0);
+    storage_unlock();
     return rv;
 }
 
+// called once the filesystem is mounted (and, unless -f, after we went
+// to the background, so threads started here survive)
+void*
+nufs_init(struct fuse_conn_info* conn)
+{
+    if (config.scrub > 0) {
+        scrub_start(config.scrub);
+    }
+    log_info("init() -> scrub %d/s, trace %s\n", config.scrub, config.trace ? config.trace : "off");
+    return NULL;
+}
+
+void
+nufs_destroy(void* private_data)
+{
+    scrub_stop();
+    if (config.trace) {
+        trace_dump();
+        trace_stop();
+    }
+    record_stop();
+    storage_lock();
+    storage_sync();
+    storage_unlock();
+    log_info("destroy()\n");
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
@@ -245,22 +610,121 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->chmod    = nufs_chmod;
     ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
     ops->utimens  = nufs_utimens;
     ops->ioctl    = nufs_ioctl;
     ops->readlink = nufs_readlink;
     ops->symlink  = nufs_symlink;
+    ops->fsync    = nufs_fsync;
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// kill -USR1 dumps the trace without going through the mount
+static void
+dump_trace(int sig)
+{
+    int saved = errno;
+    trace_dump();
+    errno = saved;
+}
+
+// makes path absolute in full, since files are opened after we went to
+// the background, in /
+static const char*
+absolute(const char* path, char* full)
+{
+    if (path[0] == '/') {
+        return path;
+    }
+    if (getcwd(full, NUFS_PATH_MAX) == NULL
+        || strlen(full) + strlen(path) + 2 > NUFS_PATH_MAX) {
+        return NULL;
+    }
+    strcat(full, "/");
+    strcat(full, path);
+    return full;
+}
+
+static int
+start_trace(const char* path)
+{
+    char full[NUFS_PATH_MAX];
+    path = absolute(path, full);
+    if (path == NULL) {
+        return -ENAMETOOLONG;
+    }
+    int rv = trace_start(path);
+    if (rv < 0) {
+        return rv;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_trace;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGUSR1, &sa, NULL);
+}
+
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    assert(argc > 2);
+    const char* image = argv[--argc];
+    int rv = storage_init(image);
+    if (rv < 0) {
+        fprintf(stderr, "nufs: can't open %s: %s\n", image, strerror(-rv));
+        return 1;
+    }
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &config, nufs_opts, NULL) == -1) {
+        return 1;
+    }
+    if (config.snapshot >= 0) {
+        if (storage_mount_snapshot(config.snapshot) < 0) {
+            fprintf(stderr, "nufs: no snapshot %d\n", config.snapshot);
+            return 1;
+        }
+        fuse_opt_add_arg(&args, "-oro");
+        // the live image is what gets scrubbed, not a snapshot of it
+        config.scrub = 0;
+    }
+    storage_set_dedup(config.dedup);
+    storage_set_atime(config.atime, config.lazytime);
+    if (config.trace && start_trace(config.trace) < 0) {
+        fprintf(stderr, "nufs: can't trace to %s\n", config.trace);
+        return 1;
+    }
+    // the recording is opened now, before we go to the background
+    if (config.record && record_start(config.record) < 0) {
+        fprintf(stderr, "nufs: can't record to %s\n", config.record);
+        return 1;
+    }
+
+    // The kernel only keeps names, attributes and pages with -o cache=<s>.
+    // That makes lookups and stats cheap, but FUSE 2.6 has no way to tell
+    // the kernel to forget names or attributes, so what changes behind its
+    // back (clones, bulk creates, snapshots, lazytime flushes) can look
+    // stale for up to that many seconds. auto_cache at least drops old
+    // pages at the next open, since those changes bump mtime. Going first
+    // lets -o entry_timeout=, attr_timeout= or kernel_cache win.
+    char cache[80];
+    snprintf(cache, sizeof(cache), "-o%sentry_timeout=%d,attr_timeout=%d",
+             config.cache > 0 ? "auto_cache," : "", config.cache, config.cache);
+    fuse_opt_insert_arg(&args, 1, cache);
+    // up to 1MB per request, FUSE 2 kernels and libfuse cut that to 128KB
+    char io[80];
+    snprintf(io, sizeof(io), "-obig_writes,max_read=%d,max_write=%d", MAX_IO, MAX_IO);
+    fuse_opt_insert_arg(&args, 1, io);
+
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return rv;
 }
 
@@ -0,0 +1,138 @@
+// ioctl commands understood by a mounted nufs, shared with nufsctl
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#define NUFS_SNAP_MAX 8
+#define NUFS_PATH_MAX 1024
+
+// the bulk commands take up to NUFS_BULK_COUNT names, one after another
+// with a NUL after each, in NUFS_BULK_NAMES bytes
+#define NUFS_BULK_COUNT 128
+#define NUFS_BULK_NAMES 4096
+
+typedef struct nufs_snap_list {
+    time_t ctim[NUFS_SNAP_MAX]; // creation time of each slot, 0 if free
+} nufs_snap_list;
+
+// like struct file_clone_range, but names the source by its path inside
+// the filesystem since nufs can't see the caller's file descriptors
+typedef struct nufs_clone_range {
+    char src[NUFS_PATH_MAX];
+    long src_offset;
+    long src_length; // 0 means up to the end of the source
+    long dest_offset;
+} nufs_clone_range;
+
+typedef struct nufs_dedup_stats {
+    long pages_written; // whole pages checked for duplicates since mount
+    long pages_shared;  // of those, how many now share an existing page
+    long hash_ns;       // time spent fingerprinting them
+    long lookup_ns;     // time spent finding and comparing candidates
+} nufs_dedup_stats;
+
+typedef struct nufs_scrub_stats {
+    long passes;         // full passes over the image, kept across mounts
+    long pages_checked;  // since mount
+    long inodes_checked; // since mount
+    long errors;         // found by the scrubber, kept across mounts
+    int  cursor;         // how far the current pass got
+    int  total;          // out of this many pages and inodes
+} nufs_scrub_stats;
+
+typedef struct nufs_bulk_create {
+    int  count;                    // names given
+    int  mode;                     // of every new entry, a file or a directory
+    int  results[NUFS_BULK_COUNT]; // out: 0 or -errno for each name
+    char names[NUFS_BULK_NAMES];
+} nufs_bulk_create;
+
+typedef struct nufs_stat {
+    int64_t size;
+    int64_t atim; // ns since the epoch
+    int64_t mtim;
+    int64_t ctim;
+    int32_t mode;
+    int32_t nlink;
+    int32_t result; // 0, or -errno and the rest is unset
+    int32_t _reserved;
+} nufs_stat;
+
+// the callbacks counted in nufs_stats, in the order of its ops array
+#define NUFS_OPS(X) \
+    X(access) X(getattr) X(readdir) X(mknod) X(mkdir) X(unlink) X(link)   \
+    X(rmdir) X(rename) X(chmod) X(truncate) X(open) X(release) X(read)    \
+    X(write) X(utimens) X(ioctl) X(symlink) X(readlink) X(fsync)
+
+#define NUFS_OP_ENUM(name) NUFS_OP_##name,
+enum nufs_op { NUFS_OPS(NUFS_OP_ENUM) NUFS_OP_COUNT };
+#undef NUFS_OP_ENUM
+
+// room for more callbacks without changing the ioctl
+#define NUFS_OP_MAX 32
+
+typedef struct nufs_op_stats {
+    uint64_t count;
+    uint64_t errors;   // calls that returned < 0
+    uint64_t bytes;    // read or written
+    uint64_t total_ns;
+    uint64_t p50_ns;   // percentiles are the top of their histogram
+    uint64_t p90_ns;   // bucket, within 1/8 of the real value
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} nufs_op_stats;
+
+// counted inside the storage layer since mount
+typedef struct nufs_counters {
+    uint64_t pages_allocated;
+    uint64_t pages_freed;    // the last reference dropped
+    uint64_t pages_copied;   // copy on write from a snapshot or a clone
+    uint64_t lookups;        // paths resolved
+    uint64_t lookup_depth;   // directories searched resolving them
+    uint64_t dirent_hits;    // names found in a directory
+    uint64_t dirent_misses;
+} nufs_counters;
+
+typedef struct nufs_stats {
+    nufs_op_stats ops[NUFS_OP_MAX];
+    nufs_counters counters;
+    uint64_t      pages_free;
+    uint64_t      inodes_free;
+} nufs_stats;
+
+typedef struct nufs_bulk_stat {
+    int       count;
+    int       _reserved;
+    nufs_stat stats[NUFS_BULK_COUNT]; // out
+    char      names[NUFS_BULK_NAMES];
+} nufs_bulk_stat;
+
+// takes a snapshot, returns its id
+#define NUFS_IOC_SNAP_CREATE _IO('N', 1)
+// deletes the snapshot with the given id
+#define NUFS_IOC_SNAP_DELETE _IOW('N', 2, int)
+#define NUFS_IOC_SNAP_LIST   _IOR('N', 3, nufs_snap_list)
+// issued on the target file, makes it share the source's pages
+#define NUFS_IOC_CLONE       _IOW('N', 4, char[NUFS_PATH_MAX])
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 5, nufs_clone_range)
+// shares identical pages across every file, returns the pages freed
+#define NUFS_IOC_DEDUP       _IO('N', 6)
+#define NUFS_IOC_DEDUP_STATS _IOR('N', 7, nufs_dedup_stats)
+// number of pages that failed their checksum since mount
+#define NUFS_IOC_CSUM_ERRORS _IOR('N', 8, long)
+#define NUFS_IOC_SCRUB_STATS _IOR('N', 9, nufs_scrub_stats)
+// issued on a directory, makes or stats many names in it under one
+// lookup of the directory. Create returns how many it made.
+#define NUFS_IOC_BULK_CREATE _IOWR('N', 10, nufs_bulk_create)
+#define NUFS_IOC_BULK_STAT   _IOWR('N', 11, nufs_bulk_stat)
+// writes the trace ring to the file given with -o trace=, returns the
+// records written
+#define NUFS_IOC_TRACE_DUMP  _IO('N', 12)
+// what /.nufs-stats shows, as numbers
+#define NUFS_IOC_STATS       _IOR('N', 13, nufs_stats)
+
+#endif
@@ -0,0 +1,382 @@
+// nufsctl: sends nufs ioctls to a mounted filesystem
+//
+//   nufsctl snapshot <mnt>            take a snapshot, prints its id
+//   nufsctl snapshot-delete <mnt> <id>
+//   nufsctl snapshots <mnt>           list snapshots
+//   nufsctl clone <src> <dst> [<src_off> <len> <dst_off>]
+//                                     make dst share src's pages
+//   nufsctl dedup <mnt>               share identical pages across all files
+//   nufsctl dedup-stats <mnt>         dedup ratio and cost of inline dedup
+//   nufsctl csum-errors <mnt>         pages that failed their checksum
+//   nufsctl scrub-stats <mnt>         progress of the background scrubber
+//   nufsctl create <dir> [<name>...]  make empty files, a batch per call
+//   nufsctl stat <dir> [<name>...]    mode, size and links of many names
+//   nufsctl stats <mnt>               calls, latency percentiles and counters
+//   nufsctl trace-dump <mnt>          write the trace ring to its file
+//   nufsctl trace <file>              print a trace dump
+//
+// create and stat read the names from stdin, one per line, if none are
+// given.
+//
+// The same numbers as stats are in <mnt>/.nufs-stats.
+//
+// A snapshot is mounted read-only with: nufs -o snapshot=<id> <mnt> <image>
+// and the scrubber is started with: nufs -o scrub[=<checks/s>] <mnt> <image>
+// The kernel keeps names and attributes for -o cache=<seconds> (10, 0 asks
+// nufs every time) and file pages until the file's mtime changes.
+// Access times follow -o strictatime, relatime (the default) or noatime,
+// and -o lazytime keeps changed times in memory until fsync or unmount.
+// Files opened with O_DIRECT or whose paths match -o direct=<pattern>
+// (e.g. direct=*.iso) are read and written around the page cache.
+// Tracing is turned on with: nufs -o trace=<file> <mnt> <image>, and the
+// ring is also dumped on kill -USR1 and at unmount. trace-dump also
+// flushes a recording, nufs -o record=<file>, for nufs-replay.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "nufs_ioctl.h"
+#include "util.h"
+#include "trace.h"
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: nufsctl snapshot <mnt>\n");
+    fprintf(stderr, "       nufsctl snapshot-delete <mnt> <id>\n");
+    fprintf(stderr, "       nufsctl snapshots <mnt>\n");
+    fprintf(stderr, "       nufsctl clone <src> <dst> [<src_off> <len> <dst_off>]\n");
+    fprintf(stderr, "       nufsctl dedup <mnt>\n");
+    fprintf(stderr, "       nufsctl dedup-stats <mnt>\n");
+    fprintf(stderr, "       nufsctl csum-errors <mnt>\n");
+    fprintf(stderr, "       nufsctl scrub-stats <mnt>\n");
+    fprintf(stderr, "       nufsctl create <dir> [<name>...]\n");
+    fprintf(stderr, "       nufsctl stat <dir> [<name>...]\n");
+    fprintf(stderr, "       nufsctl stats <mnt>\n");
+    fprintf(stderr, "       nufsctl trace-dump <mnt>\n");
+    fprintf(stderr, "       nufsctl trace <file>\n");
+    exit(2);
+}
+
+// turns a path under a nufs mount into the path nufs sees, by walking up
+// until we leave the mounted filesystem
+static int
+fs_path(const char* path, char* out)
+{
+    char full[PATH_MAX];
+    struct stat st;
+    if (realpath(path, full) == NULL || stat(full, &st) < 0) {
+        return -1;
+    }
+
+    char* cut = full + strlen(full);
+    while (cut > full) {
+        char* slash = cut - 1;
+        while (slash > full && *slash != '/') {
+            --slash;
+        }
+        char saved = *slash;
+        *slash = 0;
+        struct stat up;
+        int rv = stat(slash == full ? "/" : full, &up);
+        *slash = saved;
+        if (rv < 0 || up.st_dev != st.st_dev) {
+            break;
+        }
+        cut = slash;
+    }
+
+    if (*cut == 0) {
+        strcpy(out, "/");
+    }
+    else {
+        strncpy(out, cut, NUFS_PATH_MAX - 1);
+        out[NUFS_PATH_MAX - 1] = 0;
+    }
+    return 0;
+}
+
+static int
+clone_file(int argc, char* argv[])
+{
+    nufs_clone_range range;
+    memset(&range, 0, sizeof(range));
+    if (fs_path(argv[2], range.src) < 0) {
+        perror(argv[2]);
+        return -1;
+    }
+
+    int fd = open(argv[3], O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(argv[3]);
+        return -1;
+    }
+    int rv;
+    if (argc > 6) {
+        range.src_offset = atol(argv[4]);
+        range.src_length = atol(argv[5]);
+        range.dest_offset = atol(argv[6]);
+        rv = ioctl(fd, NUFS_IOC_CLONE_RANGE, &range);
+    }
+    else {
+        rv = ioctl(fd, NUFS_IOC_CLONE, range.src);
+    }
+    if (rv < 0) {
+        perror("clone");
+    }
+    else {
+        // the kernel doesn't know the ioctl changed the size, a setattr
+        // makes it ask again instead of waiting out attr_timeout
+        futimens(fd, NULL);
+    }
+    close(fd);
+    return rv;
+}
+
+// gets the next name for a bulk command, from the arguments if there are
+// any and stdin otherwise
+static char*
+next_name(int argc, char* argv[], int* argi, char* line)
+{
+    if (argc > 3) {
+        return *argi < argc ? argv[(*argi)++] : NULL;
+    }
+    while (fgets(line, NUFS_PATH_MAX, stdin) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] != 0) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+// sends the names to the directory fd is open on as many create or stat
+// requests as it takes
+static int
+bulk(int fd, int stat, int argc, char* argv[])
+{
+    static nufs_bulk_create create;
+    static nufs_bulk_stat st;
+    char* names = stat ? st.names : create.names;
+    int* count = stat ? &st.count : &create.count;
+    create.mode = S_IFREG | 0644;
+
+    char line[NUFS_PATH_MAX];
+    int argi = 3;
+    long made = 0;
+    char* name = next_name(argc, argv, &argi, line);
+    while (name != NULL) {
+        int used = 0;
+        *count = 0;
+        while (name != NULL && *count < NUFS_BULK_COUNT
+               && used + strlen(name) < NUFS_BULK_NAMES) {
+            strcpy(names + used, name);
+            used += strlen(name) + 1;
+            *count += 1;
+            name = next_name(argc, argv, &argi, line);
+        }
+
+        int rv = stat ? ioctl(fd, NUFS_IOC_BULK_STAT, &st)
+                      : ioctl(fd, NUFS_IOC_BULK_CREATE, &create);
+        if (rv < 0) {
+            return -1;
+        }
+        made += rv;
+        const char* nn = names;
+        for (int ii = 0; ii < *count; ++ii, nn += strlen(nn) + 1) {
+            int result = stat ? st.stats[ii].result : create.results[ii];
+            if (result < 0) {
+                fprintf(stderr, "%s: %s\n", nn, strerror(-result));
+            }
+            else if (stat) {
+                nufs_stat* ss = &st.stats[ii];
+                printf("%s\t%o\t%ld\t%d\n", nn, ss->mode, (long)ss->size, ss->nlink);
+            }
+        }
+    }
+    if (!stat) {
+        printf("%ld created\n", made);
+    }
+    return 0;
+}
+
+#define OP_NAME(name) #name,
+static const char* op_names[] = { NUFS_OPS(OP_NAME) };
+
+static void
+print_stats(nufs_stats* stats)
+{
+    printf("%-10s %10s %8s %12s %10s %10s %10s %10s\n",
+           "op", "calls", "errors", "bytes", "avg us", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < NUFS_OP_COUNT; ++op) {
+        nufs_op_stats* st = &stats->ops[op];
+        if (st->count == 0) {
+            continue;
+        }
+        printf("%-10s %10lu %8lu %12lu %10.1f %10.1f %10.1f %10.1f\n",
+               op_names[op], st->count, st->errors, st->bytes,
+               st->total_ns / 1e3 / st->count, st->p50_ns / 1e3, st->p99_ns / 1e3,
+               st->max_ns / 1e3);
+    }
+    nufs_counters* cc = &stats->counters;
+    printf("pages:   %lu allocated, %lu freed, %lu copied, %lu free\n",
+           cc->pages_allocated, cc->pages_freed, cc->pages_copied, stats->pages_free);
+    printf("inodes:  %lu free\n", stats->inodes_free);
+    printf("lookups: %lu, %.2f directories deep, %lu names found, %lu not\n",
+           cc->lookups, cc->lookups ? (double)cc->lookup_depth / cc->lookups : 0.0,
+           cc->dirent_hits, cc->dirent_misses);
+}
+
+#define TRACE_NAME(name) #name,
+static const char* trace_names[] = { TRACE_EVENTS(TRACE_NAME) };
+
+// prints a trace dump, one record per line with its time in microseconds
+// from the first one
+static int
+print_trace(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    trace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 || hdr.magic != TRACE_MAGIC
+        || hdr.size != sizeof(trace_rec)) {
+        fprintf(stderr, "%s: not a nufs trace\n", path);
+        fclose(file);
+        return -1;
+    }
+    trace_rec rec;
+    uint64_t start = 0;
+    for (uint32_t ii = 0; ii < hdr.count && fread(&rec, sizeof(rec), 1, file) == 1; ++ii) {
+        // caught half written by the dump
+        if (rec.seq == 0 || rec.event >= TRACE_NEVENTS) {
+            continue;
+        }
+        start = start ? start : rec.ns;
+        printf("%u\t%.1f\t%s\t%d\t%d\t%ld\n", rec.seq, (rec.ns - start) / 1e3,
+               trace_names[rec.event], rec.rv, rec.arg, (long)rec.off);
+    }
+    fclose(file);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        usage();
+    }
+    const char* cmd = argv[1];
+
+    if (streq(cmd, "clone")) {
+        if (argc < 4) {
+            usage();
+        }
+        return clone_file(argc, argv) < 0 ? 1 : 0;
+    }
+    if (streq(cmd, "trace")) {
+        return print_trace(argv[2]) < 0 ? 1 : 0;
+    }
+
+    int fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    int rv;
+    if (streq(cmd, "snapshot")) {
+        rv = ioctl(fd, NUFS_IOC_SNAP_CREATE);
+        if (rv >= 0) {
+            printf("%d\n", rv);
+        }
+    }
+    else if (streq(cmd, "snapshot-delete") && argc > 3) {
+        int id = atoi(argv[3]);
+        rv = ioctl(fd, NUFS_IOC_SNAP_DELETE, &id);
+    }
+    else if (streq(cmd, "snapshots")) {
+        nufs_snap_list list;
+        rv = ioctl(fd, NUFS_IOC_SNAP_LIST, &list);
+        for (int ii = 0; rv >= 0 && ii < NUFS_SNAP_MAX; ++ii) {
+            if (list.ctim[ii]) {
+                char when[64];
+                strftime(when, sizeof(when), "%F %T", localtime(&list.ctim[ii]));
+                printf("%d\t%s\n", ii, when);
+            }
+        }
+    }
+    else if (streq(cmd, "dedup")) {
+        rv = ioctl(fd, NUFS_IOC_DEDUP);
+        if (rv >= 0) {
+            printf("%d pages freed\n", rv);
+        }
+    }
+    else if (streq(cmd, "dedup-stats")) {
+        nufs_dedup_stats stats;
+        rv = ioctl(fd, NUFS_IOC_DEDUP_STATS, &stats);
+        if (rv >= 0) {
+            long written = stats.pages_written;
+            long stored = written - stats.pages_shared;
+            printf("pages written: %ld\n", written);
+            printf("pages shared:  %ld\n", stats.pages_shared);
+            printf("dedup ratio:   %.2f\n", stored ? (double)written / stored : 1.0);
+            printf("added latency: %.0f ns/page (hash %.0f, lookup %.0f)\n",
+                   written ? (double)(stats.hash_ns + stats.lookup_ns) / written : 0.0,
+                   written ? (double)stats.hash_ns / written : 0.0,
+                   written ? (double)stats.lookup_ns / written : 0.0);
+        }
+    }
+    else if (streq(cmd, "csum-errors")) {
+        long errors;
+        rv = ioctl(fd, NUFS_IOC_CSUM_ERRORS, &errors);
+        if (rv >= 0) {
+            printf("%ld\n", errors);
+        }
+    }
+    else if (streq(cmd, "scrub-stats")) {
+        nufs_scrub_stats stats;
+        rv = ioctl(fd, NUFS_IOC_SCRUB_STATS, &stats);
+        if (rv >= 0) {
+            printf("passes:         %ld\n", stats.passes);
+            printf("current pass:   %d/%d\n", stats.cursor, stats.total);
+            printf("pages checked:  %ld\n", stats.pages_checked);
+            printf("inodes checked: %ld\n", stats.inodes_checked);
+            printf("errors:         %ld\n", stats.errors);
+        }
+    }
+    else if (streq(cmd, "stats")) {
+        nufs_stats stats;
+        rv = ioctl(fd, NUFS_IOC_STATS, &stats);
+        if (rv >= 0) {
+            print_stats(&stats);
+        }
+    }
+    else if (streq(cmd, "trace-dump")) {
+        rv = ioctl(fd, NUFS_IOC_TRACE_DUMP);
+        if (rv >= 0) {
+            printf("%d records\n", rv);
+        }
+    }
+    else if (streq(cmd, "create") || streq(cmd, "stat")) {
+        rv = bulk(fd, streq(cmd, "stat"), argc, argv);
+    }
+    else {
+        usage();
+    }
+
+    if (rv < 0) {
+        perror(cmd);
+    }
+    close(fd);
+    return rv < 0 ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdlib.h>
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -12,57 +13,595 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
+#include "crc32c.h"
+#include "inode.h"
+#include "snapshot.h"
+#include "log.h"
+#include "trace.h"
+#include "stats.h"
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE  = 4096 * 256; // 1MB
+// geometry of the open image, read from its superblock
+int PAGE_BYTES  = 4096;
+int PAGE_COUNT  = 256;
+int INODE_COUNT = 256;
+// pages 0 to META_PAGES - 1 hold the superblock, the bitmaps, the inode
+// table and the per-page tables, checksums included. They change all the
+// time, so their checksums are only brought up to date when the image is
+// synced (pages_seal) and only hold until the next change (pages_unseal).
+int META_PAGES  = 4;
 
-static int   pages_fd   = -1;
-static void* pages_base =  0;
+static uint32_t zero_csum  = 0; // checksum of a page of zeros
+static long     csum_errors = 0;
+static int      meta_sealed = 0; // the metadata checksums are current
+static uint8_t* verified = 0;    // pages checked since the image was opened
 
-void
+// the image's files, more than one when it is striped across them
+static int    pages_fds[STRIPE_FILES];
+static int    pages_files  = 0;
+static size_t pages_stripe = 0; // bytes in a row in one file, when striped
+static void*  pages_base =  0;
+static size_t pages_size =  0;
+static int    pages_shared = 0; // changes go to the file, see pages_open
+
+static nufs_super* super = 0;
+
+static void pages_close_files();
+
+static uint64_t
+round_to_page(uint64_t bytes, uint64_t page_size)
+{
+    return (bytes + page_size - 1) / page_size * page_size;
+}
+
+// threads every inode that is free in the bitmap onto the free list,
+// lowest numbers first
+static void
+build_free_list(nufs_super* sb, inode* table, void* ibm)
+{
+    sb->free_inode = -1;
+    sb->free_inodes = 0;
+    for (int ii = sb->inode_count - 1; ii >= 0; --ii) {
+        if (!bitmap_get(ibm, ii)) {
+            table[ii].next_free = sb->free_inode;
+            sb->free_inode = ii;
+            sb->free_inodes += 1;
+        }
+    }
+}
+
+static int
+valid_page_size(uint32_t size)
+{
+    return size >= MIN_PAGE_BYTES && size <= MAX_PAGE_BYTES && (size & (size - 1)) == 0;
+}
+
+// opens each file of a path list separated by ':', returns how many
+static int
+open_files(const char* path, int flags, int* fds)
+{
+    char names[PATH_MAX];
+    if (strlen(path) >= sizeof(names)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(names, path);
+    int count = 0;
+    char* save = NULL;
+    for (char* name = strtok_r(names, ":", &save); name; name = strtok_r(NULL, ":", &save)) {
+        if (count == STRIPE_FILES) {
+            errno = E2BIG;
+        }
+        else {
+            fds[count] = open(name, flags, 0644);
+        }
+        if (count == STRIPE_FILES || fds[count] < 0) {
+            int rv = -errno;
+            while (count > 0) {
+                close(fds[--count]);
+            }
+            return rv;
+        }
+        count += 1;
+    }
+    return count > 0 ? count : -ENOENT;
+}
+
+// where byte off of the image is: which file, and where in it
+static int
+stripe_file(uint64_t off, int files, uint64_t stripe, uint64_t* file_off)
+{
+    uint64_t unit = off / stripe;
+    *file_off = unit / files * stripe + off % stripe;
+    return unit % files;
+}
+
+// maps size bytes of an image striped across files, each stripe bytes
+// in its own place in a range reserved for the whole image
+static void*
+map_stripes(int* fds, int files, uint64_t stripe, uint64_t size, int flags)
+{
+    char* base = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return base;
+    }
+    for (uint64_t off = 0; off < size; off += stripe) {
+        uint64_t file_off;
+        int file = stripe_file(off, files, stripe, &file_off);
+        uint64_t len = size - off < stripe ? size - off : stripe;
+        if (mmap(base + off, len, PROT_READ | PROT_WRITE, flags | MAP_FIXED,
+                 fds[file], file_off) == MAP_FAILED) {
+            munmap(base, size);
+            return MAP_FAILED;
+        }
+    }
+    return base;
+}
+
+// a stripe width that fits the page size and keeps the image under
+// STRIPE_MAPS mappings
+static int
+valid_stripe(uint64_t stripe, uint64_t page_size, uint64_t size)
+{
+    return stripe > 0 && stripe % page_size == 0 && (size + stripe - 1) / stripe <= STRIPE_MAPS;
+}
+
+// writes an empty image with room for page_count pages of page_size bytes
+// and inode_count inodes: the superblock, then each table starting on a
+// page of its own. A path list separated by ':' stripes the image across
+// the files, stripe bytes (or STRIPE_BYTES if 0) at a time.
+int
+pages_format(const char* path, int page_size, int page_count, int inode_count, int stripe)
+{
+    if (!valid_page_size(page_size) || page_count % 8 != 0
+        || inode_count % 8 != 0 || inode_count <= 0) {
+        return -EINVAL;
+    }
+    uint64_t size = (uint64_t)page_count * page_size;
+    stripe = stripe > 0 ? stripe : STRIPE_BYTES;
+
+    nufs_super sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = NUFS_MAGIC;
+    sb.version = NUFS_VERSION;
+    sb.page_size = page_size;
+    sb.page_count = page_count;
+    sb.inode_count = inode_count;
+    sb.inode_size = sizeof(inode);
+    // page 0 is the superblock, with the scrubber's progress after it
+    sb.scrub_area = 512;
+
+    uint64_t off = page_size;
+    sb.page_bitmap = off;
+    off += round_to_page(page_count / 8, page_size);
+    sb.inode_bitmap = off;
+    off += round_to_page(inode_count / 8, page_size);
+    sb.inode_table = off;
+    off += round_to_page((uint64_t)inode_count * sizeof(inode), page_size);
+    sb.page_refs = off;
+    off += round_to_page(page_count * sizeof(uint16_t), page_size);
+    sb.page_fps = off;
+    off += round_to_page(page_count * sizeof(uint32_t), page_size);
+    sb.page_csums = off;
+    off += round_to_page(page_count * sizeof(uint32_t), page_size);
+    sb.snap_table = off;
+    off += round_to_page(SNAP_COUNT * snapshot_slot_size(inode_count, page_size), page_size);
+    sb.meta_pages = off / page_size;
+    if (sb.meta_pages >= page_count) {
+        return -EINVAL;
+    }
+
+    int fds[STRIPE_FILES];
+    int files = open_files(path, O_CREAT | O_TRUNC | O_RDWR, fds);
+    if (files < 0) {
+        return files;
+    }
+    if (files > 1) {
+        if (!valid_stripe(stripe, page_size, size)) {
+            while (files > 0) {
+                close(fds[--files]);
+            }
+            return -EINVAL;
+        }
+        sb.stripe_files = files;
+        sb.stripe_bytes = stripe;
+    }
+    // each file gets its share of the stripes, the last ones may be short
+    uint64_t units = (size + stripe - 1) / stripe;
+    uint64_t file_size = files > 1 ? (units + files - 1) / files * stripe : size;
+    int rv = 0;
+    for (int ii = 0; ii < files; ++ii) {
+        if (rv == 0 && ftruncate(fds[ii], file_size) != 0) {
+            rv = -errno;
+        }
+    }
+    uint8_t* meta = MAP_FAILED;
+    if (rv == 0) {
+        meta = files > 1 ? map_stripes(fds, files, stripe, off, MAP_SHARED)
+                         : mmap(0, off, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        rv = meta == MAP_FAILED ? -ENOMEM : 0;
+    }
+    for (int ii = 0; ii < files; ++ii) {
+        close(fds[ii]);
+    }
+    if (rv < 0) {
+        return rv;
+    }
+
+    // the metadata pages are taken from the start
+    uint16_t* refs = (uint16_t*)(meta + sb.page_refs);
+    for (int ii = 0; ii < sb.meta_pages; ++ii) {
+        meta[sb.page_bitmap + ii / 8] |= 1 << (ii % 8);
+        refs[ii] = 1;
+    }
+    build_free_list(&sb, (inode*)(meta + sb.inode_table), meta + sb.inode_bitmap);
+    memcpy(meta, &sb, sizeof(sb));
+    munmap(meta, off);
+    log_info("+ pages_format(%s, %d, %d, %d) -> %d meta pages\n",
+           path, page_size, page_count, inode_count, sb.meta_pages);
+    return 0;
+}
+
+// maps an existing image and picks up its geometry. A read-only open
+// maps it privately, so nothing we change makes it back to the file. A
+// striped image is opened with its files listed in the order mkfs.nufs
+// got them, separated by ':'.
+int
+pages_open(const char* path, int writable)
+{
+    pages_files = open_files(path, writable ? O_RDWR : O_RDONLY, pages_fds);
+    if (pages_files < 0) {
+        return pages_files;
+    }
+    struct stat st;
+    nufs_super sb;
+    if (fstat(pages_fds[0], &st) != 0 || st.st_size < 4096
+        || pread(pages_fds[0], &sb, sizeof(sb), 0) != sizeof(sb)) {
+        pages_close_files();
+        return -EINVAL;
+    }
+
+    // the superblock of a striped image says how, the rest of it can only
+    // be looked at once the files are mapped together
+    int flags = writable ? MAP_SHARED : MAP_PRIVATE;
+    if (sb.magic == NUFS_MAGIC && sb.stripe_files > 1) {
+        pages_size = (uint64_t)sb.page_count * sb.page_size;
+        pages_stripe = sb.stripe_bytes;
+        if (pages_files != sb.stripe_files || !valid_page_size(sb.page_size)
+            || !valid_stripe(pages_stripe, sb.page_size, pages_size)) {
+            fprintf(stderr, "nufs: %s: the image is striped across %d files\n",
+                    path, sb.stripe_files);
+            pages_close_files();
+            return -EINVAL;
+        }
+        // mapping past the end of a short file would fault on first use
+        uint64_t units = (pages_size + pages_stripe - 1) / pages_stripe;
+        uint64_t share = (units + pages_files - 1) / pages_files * pages_stripe;
+        for (int ii = 0; ii < pages_files; ++ii) {
+            if (fstat(pages_fds[ii], &st) != 0 || (uint64_t)st.st_size < share) {
+                fprintf(stderr, "nufs: %s: stripe file %d is shorter than %lu bytes\n",
+                        path, ii + 1, (unsigned long)share);
+                pages_close_files();
+                return -EINVAL;
+            }
+        }
+        pages_base = map_stripes(pages_fds, pages_files, pages_stripe, pages_size, flags);
+    }
+    else if (pages_files > 1) {
+        fprintf(stderr, "nufs: %s: the image isn't striped\n", path);
+        pages_close_files();
+        return -EINVAL;
+    }
+    else {
+        pages_size = st.st_size;
+        pages_base = mmap(0, pages_size, PROT_READ | PROT_WRITE, flags, pages_fds[0], 0);
+    }
+    pages_shared = writable;
+    if (pages_base == MAP_FAILED) {
+        pages_close_files();
+        return -ENOMEM;
+    }
+
+    super = pages_base;
+    // images from before the superblock have bit 0 of the page bitmap
+    // (page 0 itself) set where the magic is, and it is clear in NUFS_MAGIC.
+    // Those and version 1 ones have 48 byte inodes, see upgrade.c.
+    if (super->magic != NUFS_MAGIC || super->version < 2
+        || super->inode_size != sizeof(inode)) {
+        fprintf(stderr, "nufs: %s was made by an older nufs, "
+                "mkfs.nufs -u %s converts it\n", path, path);
+        pages_free();
+        return -EINVAL;
+    }
+    if (super->version > NUFS_VERSION || !valid_page_size(super->page_size)
+        || (uint64_t)super->page_count * super->page_size > pages_size
+        || super->meta_pages >= super->page_count) {
+        fprintf(stderr, "nufs: %s: bad superblock\n", path);
+        pages_free();
+        return -EINVAL;
+    }
+    PAGE_BYTES = super->page_size;
+    PAGE_COUNT = super->page_count;
+    INODE_COUNT = super->inode_count;
+    META_PAGES = super->meta_pages;
+    free(verified);
+    verified = calloc(PAGE_COUNT, 1);
+    if (verified == NULL) {
+        pages_free();
+        return -ENOMEM;
+    }
+
+    // version 2 images only have the inode bitmap
+    if (super->version == 2) {
+        build_free_list(super, get_inode_table(), get_inode_bitmap());
+        super->version = 3;
+    }
+    // directories without INODE_PACKED get packed as they change
+    if (super->version == 3) {
+        super->version = 4;
+    }
+    // and the metadata checksums are made on the first sync
+    if (super->version == 4) {
+        super->version = 5;
+    }
+    meta_sealed = super->meta_csums;
+    if (writable) {
+        // whatever happens from here on, only a sync vouches for them again
+        super->meta_csums = 0;
+        msync(super, PAGE_BYTES, MS_SYNC);
+    }
+
+    static char zeros[MAX_PAGE_BYTES];
+    zero_csum = crc32c(0, zeros, PAGE_BYTES);
+    return 0;
+}
+
+// opens the image at path, formatting it first if it is new, returns 0
+// or a negative errno
+int
 pages_init(const char* path)
 {
-    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
-    assert(pages_fd != -1);
+    // a new image gets the default geometry, mkfs.nufs makes other ones
+    char first[PATH_MAX];
+    snprintf(first, sizeof(first), "%.*s", (int)strcspn(path, ":"), path);
+    struct stat st;
+    if (stat(first, &st) != 0 || st.st_size == 0) {
+        int rv = pages_format(path, 4096, 256, 256, 0);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return pages_open(path, 1);
+}
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
-    assert(rv == 0);
+// writes the image's changed pages to the file and waits for them
+int
+pages_sync()
+{
+    pages_seal();
+    return msync(pages_base, pages_size, MS_SYNC) == 0 ? 0 : -errno;
+}
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
-    assert(pages_base != MAP_FAILED);
+// drops count pages from pnum on out of memory, ours and the kernel's
+// cache of the file, they are read from the file again when next used.
+// Pages not written back yet stay cached until they are.
+void
+pages_forget(int pnum, int count)
+{
+    if (!pages_shared) {
+        // a private mapping would lose its changes
+        return;
+    }
+    // they come back from the file, which may not hold what we checked
+    memset(verified + pnum, 0, count);
+    uint64_t off = (uint64_t)PAGE_BYTES * pnum;
+    uint64_t end = off + (uint64_t)PAGE_BYTES * count;
+    madvise((char*)pages_base + off, end - off, MADV_DONTNEED);
+    if (pages_files == 1) {
+        posix_fadvise(pages_fds[0], off, end - off, POSIX_FADV_DONTNEED);
+        return;
+    }
+    // a piece at a time, each in its file
+    while (off < end) {
+        uint64_t file_off;
+        int file = stripe_file(off, pages_files, pages_stripe, &file_off);
+        uint64_t len = pages_stripe - off % pages_stripe;
+        len = len < end - off ? len : end - off;
+        posix_fadvise(pages_fds[file], file_off, len, POSIX_FADV_DONTNEED);
+        off += len;
+    }
+}
 
-    void* pbm = get_pages_bitmap();
-    bitmap_put(pbm, 0, 1);
+static void
+pages_close_files()
+{
+    while (pages_files > 0) {
+        close(pages_fds[--pages_files]);
+    }
 }
 
 void
 pages_free()
 {
-    int rv = munmap(pages_base, NUFS_SIZE);
+    if (pages_shared) {
+        pages_seal();
+    }
+    int rv = munmap(pages_base, pages_size);
     assert(rv == 0);
+    pages_close_files();
+    free(verified);
+    verified = 0;
+}
+
+nufs_super*
+get_super()
+{
+    return super;
 }
 
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + 4096 * pnum;
+    return (uint8_t*)pages_base + (size_t)PAGE_BYTES * pnum;
+}
+
+int
+bytes_to_pages(int64_t bytes)
+{
+    return (bytes + PAGE_BYTES - 1) / PAGE_BYTES;
 }
 
 void*
 get_pages_bitmap()
 {
-    return pages_get_page(0);
+    return (uint8_t*)pages_base + super->page_bitmap;
 }
 
 void*
 get_inode_bitmap()
 {
-    uint8_t* page = pages_get_page(0);
-    return (void*)(page + 32);
+    return (uint8_t*)pages_base + super->inode_bitmap;
+}
+
+void*
+get_inode_table()
+{
+    return (uint8_t*)pages_base + super->inode_table;
+}
+
+uint16_t*
+get_page_refs()
+{
+    return (uint16_t*)((uint8_t*)pages_base + super->page_refs);
+}
+
+void*
+get_snapshot_table()
+{
+    return (uint8_t*)pages_base + super->snap_table;
+}
+
+// the dedup fingerprint of each page
+uint32_t*
+get_page_fps()
+{
+    return (uint32_t*)((uint8_t*)pages_base + super->page_fps);
+}
+
+// the checksum of each page
+uint32_t*
+get_page_csums()
+{
+    return (uint32_t*)((uint8_t*)pages_base + super->page_csums);
+}
+
+// a little room for the scrubber's progress
+void*
+get_scrub_area()
+{
+    return (uint8_t*)pages_base + super->scrub_area;
+}
+
+// call after changing a page, so its checksum keeps up
+void
+page_written(int pnum)
+{
+    if (pnum >= META_PAGES) {
+        get_page_csums()[pnum] = crc32c(0, pages_get_page(pnum), PAGE_BYTES);
+    }
+}
+
+// the metadata pages with a checksum: all but the superblock, which the
+// scrubber keeps its place in, and the checksum table itself
+int
+page_meta_csummed(int pnum)
+{
+    uint64_t off = (uint64_t)pnum * PAGE_BYTES;
+    uint64_t csums_end = super->page_csums + (uint64_t)PAGE_COUNT * sizeof(uint32_t);
+    return pnum > 0 && pnum < META_PAGES
+        && (off + PAGE_BYTES <= super->page_csums || off >= csums_end);
+}
+
+// brings the metadata checksums up to date, for when nothing is changing
+void
+pages_seal()
+{
+    uint32_t* csums = get_page_csums();
+    for (int pnum = 1; pnum < META_PAGES; ++pnum) {
+        if (page_meta_csummed(pnum)) {
+            csums[pnum] = crc32c(0, pages_get_page(pnum), PAGE_BYTES);
+        }
+    }
+    super->meta_csums = 1;
+    meta_sealed = 1;
+}
+
+// the metadata is about to change, so its checksums no longer hold. The
+// superblock goes out straight away, or a crash could leave it vouching
+// for metadata that changed.
+void
+pages_unseal()
+{
+    meta_sealed = 0;
+    if (super->meta_csums) {
+        super->meta_csums = 0;
+        if (pages_shared) {
+            msync(super, PAGE_BYTES, MS_SYNC);
+        }
+    }
+}
+
+// compares a page with its checksum, returns -1 if they don't match.
+// Metadata pages are only checked while sealed. Nothing is counted, so
+// the scrubber can keep its own tally.
+int
+page_csum_check(int pnum)
+{
+    if (pnum < META_PAGES && (!meta_sealed || !page_meta_csummed(pnum))) {
+        return 0;
+    }
+    if (crc32c(0, pages_get_page(pnum), PAGE_BYTES) != get_page_csums()[pnum]) {
+        return -1;
+    }
+    return 0;
+}
+
+// checks a page against its checksum before we hand out its contents,
+// returns -1 (and counts it) if they don't match
+int
+page_verify(int pnum)
+{
+    if (page_csum_check(pnum) < 0) {
+        csum_errors += 1;
+        log_error("nufs: checksum mismatch on page %d\n", pnum);
+        return -1;
+    }
+    return 0;
+}
+
+// like page_verify, but a page that passed once isn't checked again until
+// the image is reopened. Our own changes keep its checksum current, and
+// the scrubber keeps looking at it.
+int
+page_verify_once(int pnum)
+{
+    if (verified[pnum]) {
+        return 0;
+    }
+    if (page_verify(pnum) < 0) {
+        return -1;
+    }
+    verified[pnum] = 1;
+    return 0;
+}
+
+long
+pages_csum_errors()
+{
+    return csum_errors;
 }
 
 int
@@ -73,7 +612,14 @@ alloc_page()
     for (int ii = 1; ii < PAGE_COUNT; ++ii) {
         if (!bitmap_get(pbm, ii)) {
             bitmap_put(pbm, ii, 1);
-            printf("+ alloc_page() -> %d\n", ii);
+            get_page_refs()[ii] = 1;
+            get_page_fps()[ii] = 0;
+            // new pages start out zeroed, so they are never stale data
+            memset(pages_get_page(ii), 0, PAGE_BYTES);
+            get_page_csums()[ii] = zero_csum;
+            log_debug("+ alloc_page() -> %d\n", ii);
+            stats_count(pages_allocated, 1);
+            trace(ALLOC_PAGE, ii, 0, 0);
             return ii;
         }
     }
@@ -81,11 +627,72 @@ alloc_page()
     return -1;
 }
 
+// drops a reference to the page, the page is only free once nothing
+// (file, snapshot or clone) points at it anymore
 void
 free_page(int pnum)
 {
-    printf("+ free_page(%d)\n", pnum);
+    if (pnum <= 0) {
+        return;
+    }
+    log_debug("+ free_page(%d)\n", pnum);
+    trace(FREE_PAGE, 0, pnum, 0);
+    uint16_t* refs = get_page_refs();
+    if (refs[pnum] > 1) {
+        refs[pnum] -= 1;
+        return;
+    }
+    refs[pnum] = 0;
+    get_page_fps()[pnum] = 0;
+    stats_count(pages_freed, 1);
     void* pbm = get_pages_bitmap();
     bitmap_put(pbm, pnum, 0);
 }
 
+// adds a reference to an allocated page
+void
+page_ref(int pnum)
+{
+    if (pnum > 0) {
+        get_page_refs()[pnum] += 1;
+    }
+}
+
+int
+page_refs(int pnum)
+{
+    return get_page_refs()[pnum];
+}
+
+// a new page with the same contents as pnum, -1 if there is no room
+int
+page_dup(int pnum)
+{
+    int copy = alloc_page();
+    if (copy < 0) {
+        return -1;
+    }
+    memcpy(pages_get_page(copy), pages_get_page(pnum), PAGE_BYTES);
+    get_page_csums()[copy] = get_page_csums()[pnum];
+    return copy;
+}
+
+// returns a page with the same contents that only the caller references,
+// copying the page if anyone else still points at it
+int
+page_cow(int pnum)
+{
+    if (page_refs(pnum) <= 1) {
+        return pnum;
+    }
+    int copy = page_dup(pnum);
+    if (copy < 0) {
+        return -1;
+    }
+    free_page(pnum);
+    log_debug("+ page_cow(%d) -> %d\n", pnum, copy);
+    stats_count(pages_copied, 1);
+    trace(PAGE_COW, copy, pnum, 0);
+    return copy;
+}
+
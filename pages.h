@@ -4,13 +4,91 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
 
-void pages_init(const char* path);
+#define NUFS_MAGIC   0x5346554e // "NUFS"
+#define NUFS_VERSION 5 // 2: 128 byte inodes, 3: inode free list, 4: packed directories,
+                       // 5: metadata checksums
+
+// the page size is picked per image, see mkfs.nufs -b
+#define MIN_PAGE_BYTES 4096
+#define MAX_PAGE_BYTES 65536
+
+// an image can be striped across up to STRIPE_FILES files, see mkfs.nufs -s
+#define STRIPE_FILES 16
+#define STRIPE_BYTES (1 << 20) // the default stripe width
+#define STRIPE_MAPS  32768     // stripes an image can have, each is a mapping
+
+// the first bytes of page 0
+typedef struct nufs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint32_t inode_count;
+    uint32_t meta_pages; // pages taken by the superblock and the tables
+    uint32_t inode_size;
+    uint32_t _reserved;
+    // where each table starts, in bytes from the start of the image
+    uint64_t page_bitmap;
+    uint64_t inode_bitmap;
+    uint64_t inode_table;
+    uint64_t page_refs;
+    uint64_t snap_table;
+    uint64_t page_fps;
+    uint64_t page_csums;
+    uint64_t scrub_area;
+    // from version 3
+    int32_t  free_inode;  // head of the inode free list, -1 if none
+    uint32_t free_inodes; // length of the free list
+    // 0 before striping, an image on one file has them 0 still
+    uint32_t stripe_files; // files the image is striped across
+    uint32_t stripe_bytes; // bytes of the image in a row in each file
+    // from version 5, set while the metadata pages' checksums are current
+    uint32_t meta_csums;
+} nufs_super;
+
+// page refcounts are 16 bits. Dedup and clones stop sharing a page at
+// PAGE_REFS_SHARE and make a copy, which leaves the rest for snapshots
+// and for copies of shared indirect pages, which can't do without.
+#define PAGE_REFS_MAX   0xffff
+#define PAGE_REFS_SHARE (PAGE_REFS_MAX - 4096)
+
+extern int PAGE_BYTES;
+extern int PAGE_COUNT;
+extern int INODE_COUNT;
+extern int META_PAGES;
+
+int pages_format(const char* path, int page_size, int page_count, int inode_count, int stripe);
+int pages_open(const char* path, int writable);
+int pages_init(const char* path);
+int pages_sync();
+void pages_forget(int pnum, int count);
 void pages_free();
+nufs_super* get_super();
 void* pages_get_page(int pnum);
+int bytes_to_pages(int64_t bytes);
 void* get_pages_bitmap();
 void* get_inode_bitmap();
+void* get_inode_table();
+uint16_t* get_page_refs();
+void* get_snapshot_table();
+uint32_t* get_page_fps();
+uint32_t* get_page_csums();
+void* get_scrub_area();
+void page_written(int pnum);
+int page_csum_check(int pnum);
+int page_verify(int pnum);
+int page_verify_once(int pnum);
+int page_meta_csummed(int pnum);
+void pages_seal();
+void pages_unseal();
+long pages_csum_errors();
 int alloc_page();
 void free_page(int pnum);
+void page_ref(int pnum);
+int page_refs(int pnum);
+int page_dup(int pnum);
+int page_cow(int pnum);
 
 #endif
@@ -0,0 +1,190 @@
+// nufs-replay: runs a recording against an image, without FUSE
+//
+//   nufs-replay [-r] [-v] <recording> <image>
+//
+// A recording comes from nufs -o record=<file>. Each call in it is made
+// again on the storage layer, in the same order, as fast as possible or,
+// with -r, at the times they were first made. The image should be a copy
+// of the one that was mounted when the recording started, or the calls
+// won't find what they found then; -v prints every call that returns
+// something other than it returned when recorded. Writes are replayed
+// with the same sizes and offsets but not the same bytes, and times set
+// with utimens to the same times.
+//
+// Prints the calls by kind with their latencies, as in /.nufs-stats.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "trace.h"
+#include "stats.h"
+
+static const char* op_names[] = {
+#define OP_NAME(name) #name,
+    NUFS_OPS(OP_NAME)
+#undef OP_NAME
+};
+
+// stands in for the kernel's readdir buffer, which takes a page of
+// entries per call
+static int
+fill_page(void* buf, const char* name, const struct stat* st, off_t next)
+{
+    int* used = buf;
+    *used += (24 + strlen(name) + 7) & ~7;
+    return *used > 4096;
+}
+
+// makes the call in rec again, returns what it returned
+static int
+replay(record_op* rec, const char* path, const char* path2)
+{
+    static char* data = 0;
+    static int data_size = 0;
+    if ((rec->op == NUFS_OP_read || rec->op == NUFS_OP_write || rec->op == NUFS_OP_readlink)
+        && rec->arg > data_size) {
+        data_size = rec->arg;
+        data = realloc(data, data_size);
+        memset(data, 'r', data_size);
+    }
+
+    struct stat st;
+    int used = 0;
+    if (strcmp(path, "/.nufs-stats") == 0) {
+        return rec->rv;
+    }
+    switch (rec->op) {
+    case NUFS_OP_access:
+        return storage_access(path);
+    case NUFS_OP_getattr:
+        if (strcmp(path, "/") == 0) {
+            return 0;
+        }
+        return storage_stat(path, &st);
+    case NUFS_OP_readdir:
+        return storage_readdir(path, rec->off, fill_page, &used);
+    case NUFS_OP_mknod:
+        return storage_mknod(path, rec->arg);
+    case NUFS_OP_mkdir:
+        return storage_mknod(path, rec->arg | 040000);
+    case NUFS_OP_unlink:
+        return storage_unlink(path);
+    case NUFS_OP_link:
+        return storage_link(path2, path);
+    case NUFS_OP_rename:
+        return storage_rename(path, path2);
+    case NUFS_OP_truncate:
+        return storage_truncate(path, rec->off);
+    case NUFS_OP_release:
+        return storage_compress(path);
+    case NUFS_OP_read:
+        return storage_read(path, data, rec->arg, rec->off);
+    case NUFS_OP_write:
+        return storage_write(path, data, rec->arg, rec->off);
+    case NUFS_OP_utimens: {
+        struct timespec ts[2] = { record_timespec(rec->off), record_timespec(rec->off2) };
+        return storage_set_time(path, ts);
+    }
+    case NUFS_OP_symlink:
+        return storage_symlink(path, path2);
+    case NUFS_OP_readlink:
+        return storage_readlink(path, data, rec->arg);
+    case NUFS_OP_fsync:
+        return storage_sync();
+    default:
+        // open, chmod and rmdir don't reach the storage layer, ioctls
+        // carry data the recording doesn't have and /.nufs-stats isn't
+        // on the image
+        return rec->rv;
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    int timed = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "rv")) != -1) {
+        if (opt == 'r') {
+            timed = 1;
+        }
+        else if (opt == 'v') {
+            verbose = 1;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "usage: nufs-replay [-r] [-v] <recording> <image>\n");
+        return 2;
+    }
+
+    FILE* file = fopen(argv[optind], "r");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    trace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 || hdr.magic != RECORD_MAGIC
+        || hdr.size != sizeof(record_op)) {
+        fprintf(stderr, "nufs-replay: %s: not a nufs recording\n", argv[optind]);
+        return 1;
+    }
+    int rv = storage_init(argv[optind + 1]);
+    if (rv < 0) {
+        fprintf(stderr, "nufs-replay: can't open %s: %s\n", argv[optind + 1], strerror(-rv));
+        return 1;
+    }
+
+    record_op rec;
+    char paths[2 * NUFS_PATH_MAX];
+    long calls = 0;
+    long differ = 0;
+    uint64_t begin = stats_now();
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        if (rec.len == 0 || rec.len > sizeof(paths) || rec.op >= NUFS_OP_COUNT
+            || fread(paths, rec.len, 1, file) != 1 || paths[rec.len - 1] != 0) {
+            fprintf(stderr, "nufs-replay: the recording is cut short after %ld calls\n", calls);
+            break;
+        }
+        const char* path2 = rec.npaths > 1 ? paths + strlen(paths) + 1 : NULL;
+
+        if (timed) {
+            uint64_t now = stats_now() - begin;
+            if (rec.ns > now) {
+                struct timespec ts = { (rec.ns - now) / 1000000000, (rec.ns - now) % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        uint64_t start = stats_now();
+        int rv = replay(&rec, paths, path2);
+        stats_op(rec.op, start, rv, rec.op == NUFS_OP_read || rec.op == NUFS_OP_write ? rv : 0);
+
+        calls += 1;
+        if (rv != rec.rv) {
+            differ += 1;
+            if (verbose) {
+                printf("%ld: %s(%s%s%s) -> %d, was %d\n", calls, op_names[rec.op], paths,
+                       path2 ? ", " : "", path2 ? path2 : "", rv, rec.rv);
+            }
+        }
+    }
+    double secs = (stats_now() - begin) / 1e9;
+    fclose(file);
+
+    char text[8192];
+    stats_render(text, sizeof(text));
+    fputs(text, stdout);
+    printf("# %ld calls in %.3fs, %.0f calls/s, %ld returned something else\n",
+           calls, secs, secs > 0 ? calls / secs : 0.0, differ);
+    storage_close();
+    return 0;
+}
@@ -0,0 +1,218 @@
+// Implementation of scrub.h
+//
+// The scrubber is a low priority thread that walks every allocated page,
+// checking it against its checksum and its refcount against the page
+// bitmap, and then every inode in use, checking its page pointers and,
+// for directories, the entries. It takes the storage lock for one page or
+// one inode at a time and sleeps in between to stay under its rate, so
+// the FUSE loop only ever waits for a single check. Where it is in the
+// pass is kept on the image, so a remount picks up where it left off.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+
+#include "scrub.h"
+#include "storage.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "directory.h"
+#include "log.h"
+
+// what the scrubber keeps on the image
+typedef struct scrub_state {
+    int  cursor; // next page, or PAGE_COUNT + next inode
+    int  _reserved;
+    long passes;
+    long errors;
+} scrub_state;
+
+static pthread_t scrub_thread;
+static volatile int scrub_running = 0;
+static int scrub_rate = 0; // checks per second
+static long scrub_pages = 0;
+static long scrub_inodes = 0;
+
+static scrub_state*
+get_scrub_state()
+{
+    return get_scrub_area();
+}
+
+static void
+scrub_error(const char* what, int num)
+{
+    log_error("nufs scrub: %s %d\n", what, num);
+    get_scrub_state()->errors += 1;
+}
+
+static void
+scrub_page(int pnum)
+{
+    scrub_pages += 1;
+    // the metadata pages aren't counted, and their checksums only hold
+    // from a sync until the next change
+    if (pnum < META_PAGES) {
+        if (page_csum_check(pnum) < 0) {
+            scrub_error("checksum mismatch on metadata page", pnum);
+        }
+        return;
+    }
+    int used = bitmap_get(get_pages_bitmap(), pnum);
+    int refs = page_refs(pnum);
+    if (used && refs == 0) {
+        scrub_error("allocated page without references:", pnum);
+    }
+    if (!used && refs != 0) {
+        scrub_error("free page with references:", pnum);
+    }
+    if (used && page_csum_check(pnum) < 0) {
+        scrub_error("checksum mismatch on page", pnum);
+    }
+}
+
+// a page pointer has to land on an allocated page
+static int
+scrub_ptr(int ptr)
+{
+    int pnum = ptr_pnum(ptr);
+    return pnum > 0 && pnum < PAGE_COUNT && bitmap_get(get_pages_bitmap(), pnum);
+}
+
+static int
+scrub_dirent(dirent* entry, int slot, void* arg)
+{
+    int child = entry->inum;
+    if (child < 0 || child >= INODE_COUNT || !bitmap_get(get_inode_bitmap(), child)) {
+        scrub_error("entry pointing at a free inode in directory", *(int*)arg);
+    }
+    return 0;
+}
+
+static void
+scrub_inode(int inum)
+{
+    scrub_inodes += 1;
+    if (!bitmap_get(get_inode_bitmap(), inum)) {
+        return;
+    }
+    inode* node = get_inode(inum);
+    if (node->refs < 1) {
+        scrub_error("inode in use without links:", inum);
+    }
+    if (node->size < 0 || node->size / PAGE_BYTES >= INODE_MAX_PAGES) {
+        scrub_error("inode with a bad size:", inum);
+        return;
+    }
+    if (node->iptr != 0 && !scrub_ptr(node->iptr)) {
+        scrub_error("bad indirect page in inode", inum);
+        return;
+    }
+    for (int pidx = 0; pidx <= node->size / PAGE_BYTES; ++pidx) {
+        int ptr = inode_get_ptr(node, pidx);
+        // only the first pages of a compressed cluster point anywhere,
+        // and pages that were never written don't have one yet
+        if (ptr == PTR_Z || ptr == 0) {
+            continue;
+        }
+        if (!scrub_ptr(ptr)) {
+            scrub_error("bad page pointer in inode", inum);
+            return;
+        }
+    }
+
+    if (S_ISDIR(node->mode)) {
+        if (directory_check(node) > 0) {
+            scrub_error("damaged entries in directory", inum);
+        }
+        directory_walk(node, 0, scrub_dirent, &inum);
+    }
+}
+
+// checks the next page or inode, returns 1 when that finished a pass
+int
+scrub_step()
+{
+    scrub_state* state = get_scrub_state();
+    int total = PAGE_COUNT + INODE_COUNT;
+    if (state->cursor < 0 || state->cursor >= total) {
+        state->cursor = 0;
+    }
+
+    if (state->cursor < PAGE_COUNT) {
+        scrub_page(state->cursor);
+    }
+    else {
+        scrub_inode(state->cursor - PAGE_COUNT);
+    }
+
+    state->cursor += 1;
+    if (state->cursor == total) {
+        state->cursor = 0;
+        state->passes += 1;
+        log_info("+ scrub pass %ld done, %ld errors so far\n", state->passes, state->errors);
+        return 1;
+    }
+    return 0;
+}
+
+static void*
+scrub_main(void* arg)
+{
+    // stay out of the way of the FUSE loop
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    struct timespec pause;
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000000000L / scrub_rate;
+    while (scrub_running) {
+        storage_lock_scrub();
+        scrub_step();
+        storage_unlock();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// starts scrubbing at rate checks (pages or inodes) per second
+void
+scrub_start(int rate)
+{
+    if (scrub_running || rate <= 0) {
+        return;
+    }
+    scrub_rate = rate < 1000000 ? rate : 1000000;
+    scrub_running = 1;
+    if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0) {
+        scrub_running = 0;
+    }
+}
+
+void
+scrub_stop()
+{
+    if (!scrub_running) {
+        return;
+    }
+    scrub_running = 0;
+    pthread_join(scrub_thread, NULL);
+}
+
+void
+scrub_get_stats(scrub_stats* stats)
+{
+    scrub_state* state = get_scrub_state();
+    stats->passes = state->passes;
+    stats->pages_checked = scrub_pages;
+    stats->inodes_checked = scrub_inodes;
+    stats->errors = state->errors;
+    stats->cursor = state->cursor;
+    stats->total = PAGE_COUNT + INODE_COUNT;
+}
@@ -0,0 +1,20 @@
+// background verification of the whole image
+
+#ifndef SCRUB_H
+#define SCRUB_H
+
+typedef struct scrub_stats {
+    long passes;         // full passes completed
+    long pages_checked;  // since mount
+    long inodes_checked; // since mount
+    long errors;         // checksum and consistency errors, all passes
+    int  cursor;         // position in the current pass
+    int  total;          // positions in a pass: every page, then every inode
+} scrub_stats;
+
+void scrub_start(int rate);
+void scrub_stop();
+int  scrub_step();
+void scrub_get_stats(scrub_stats* stats);
+
+#endif
@@ -0,0 +1,157 @@
+// Implementation of snapshot.h
+//
+// A snapshot is a copy of the inode table. Taking one adds a reference to
+// every page the live inodes point at, so from then on the live filesystem
+// copies a page before changing it (see page_cow) and the snapshot keeps
+// seeing the old contents.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "snapshot.h"
+#include "inode.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "util.h"
+#include "log.h"
+
+// pages needed to hold a copy of the inode table
+int
+snapshot_itab_pages(int inode_count, int page_size) {
+    return (inode_count * sizeof(inode) + page_size - 1) / page_size;
+}
+
+static size_t
+snapshot_ctim_offset(int inode_count, int page_size) {
+    size_t off = sizeof(snapshot) + snapshot_itab_pages(inode_count, page_size) * sizeof(int);
+    return (off + 7) & ~7;
+}
+
+// the size of a slot
+size_t
+snapshot_slot_size(int inode_count, int page_size) {
+    size_t off = snapshot_ctim_offset(inode_count, page_size)
+        + sizeof(time_t) + inode_count / 8;
+    return (off + 7) & ~7;
+}
+
+// when the snapshot was taken
+time_t*
+snapshot_ctim(snapshot* snap) {
+    return (time_t*)((char*)snap + snapshot_ctim_offset(INODE_COUNT, PAGE_BYTES));
+}
+
+// which inodes were in use
+char*
+snapshot_bitmap(snapshot* snap) {
+    return (char*)snapshot_ctim(snap) + sizeof(time_t);
+}
+
+snapshot*
+get_snapshot(int id) {
+    if (id < 0 || id >= SNAP_COUNT) {
+        return NULL;
+    }
+    char* snaps = get_snapshot_table();
+    return (snapshot*)(snaps + id * snapshot_slot_size(INODE_COUNT, PAGE_BYTES));
+}
+
+// references every page the inode points at directly. Pages behind the
+// indirect page are covered by the reference on the indirect page itself.
+static void
+snapshot_ref_inode(inode* node) {
+    for (int ii = 0; ii < nptrs; ++ii) {
+        page_ref(ptr_pnum(node->ptrs[ii]));
+    }
+    page_ref(node->iptr);
+}
+
+// takes a snapshot of the live filesystem, returns its id
+int
+snapshot_create() {
+    int id = -1;
+    for (int ii = 0; ii < SNAP_COUNT; ++ii) {
+        if (!get_snapshot(ii)->used) {
+            id = ii;
+            break;
+        }
+    }
+    if (id < 0) {
+        return -ENOSPC;
+    }
+    snapshot* snap = get_snapshot(id);
+    int npages = snapshot_itab_pages(INODE_COUNT, PAGE_BYTES);
+
+    for (int ii = 0; ii < npages; ++ii) {
+        snap->itab[ii] = alloc_page();
+        if (snap->itab[ii] < 0) {
+            for (int jj = 0; jj < ii; ++jj) {
+                free_page(snap->itab[jj]);
+            }
+            return -ENOSPC;
+        }
+    }
+
+    // copy the table a page at a time
+    char* table = (char*)get_inode(0);
+    int bytes = INODE_COUNT * sizeof(inode);
+    for (int ii = 0; ii < npages; ++ii) {
+        int len = min(PAGE_BYTES, bytes - ii * PAGE_BYTES);
+        memcpy(pages_get_page(snap->itab[ii]), table + ii * PAGE_BYTES, len);
+        page_written(snap->itab[ii]);
+    }
+    memcpy(snapshot_bitmap(snap), get_inode_bitmap(), INODE_COUNT / 8);
+
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (bitmap_get(get_inode_bitmap(), ii)) {
+            snapshot_ref_inode(get_inode(ii));
+        }
+    }
+
+    *snapshot_ctim(snap) = time(NULL);
+    snap->used = 1;
+    log_info("+ snapshot_create() -> %d\n", id);
+    return id;
+}
+
+// gathers the snapshot's inode table into one malloc'd array
+inode*
+snapshot_load(int id) {
+    snapshot* snap = get_snapshot(id);
+    if (snap == NULL || !snap->used) {
+        return NULL;
+    }
+    int npages = snapshot_itab_pages(INODE_COUNT, PAGE_BYTES);
+    char* table = aligned_alloc(64, npages * PAGE_BYTES);
+    for (int ii = 0; ii < npages; ++ii) {
+        memcpy(table + ii * PAGE_BYTES, pages_get_page(snap->itab[ii]), PAGE_BYTES);
+    }
+    return (inode*)table;
+}
+
+// drops the snapshot and every page reference it held
+int
+snapshot_delete(int id) {
+    snapshot* snap = get_snapshot(id);
+    if (snap == NULL || !snap->used) {
+        return -ENOENT;
+    }
+
+    inode* table = snapshot_load(id);
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (bitmap_get(snapshot_bitmap(snap), ii)) {
+            inode_release(&table[ii]);
+        }
+    }
+    free(table);
+
+    for (int ii = 0; ii < snapshot_itab_pages(INODE_COUNT, PAGE_BYTES); ++ii) {
+        free_page(snap->itab[ii]);
+    }
+    snap->used = 0;
+    log_info("+ snapshot_delete(%d)\n", id);
+    return 0;
+}
@@ -0,0 +1,30 @@
+// read-only point-in-time copies of the whole filesystem
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "inode.h"
+
+#define SNAP_COUNT 8
+
+// A slot of the snapshot table. How big it is depends on the inode count:
+// the pages of the copied inode table are followed by the creation time
+// and then a copy of the inode bitmap, see snapshot_ctim/snapshot_bitmap.
+typedef struct snapshot {
+    int used;   // is this slot taken?
+    int itab[]; // pages holding the copied inode table
+} snapshot;
+
+int snapshot_itab_pages(int inode_count, int page_size);
+size_t snapshot_slot_size(int inode_count, int page_size);
+time_t* snapshot_ctim(snapshot* snap);
+char* snapshot_bitmap(snapshot* snap);
+snapshot* get_snapshot(int id);
+int snapshot_create();
+int snapshot_delete(int id);
+inode* snapshot_load(int id);
+
+#endif
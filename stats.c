@@ -0,0 +1,168 @@
+// Implementation of stats.h
+//
+// Each callback gets a count and a latency histogram in the style of
+// HdrHistogram: the first 8 buckets are 1ns wide, after that every power
+// of two is split into 8, so a bucket is never wider than 1/8 of the
+// values in it. 312 buckets reach past 1000 seconds. Updates are relaxed
+// atomic adds, the numbers only have to add up once the calls are done.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "pages.h"
+#include "bitmap.h"
+
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_MAG 40
+#define BUCKETS ((MAX_MAG - SUB_BITS + 2) * SUB_COUNT)
+
+typedef struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[BUCKETS];
+} op_stats;
+
+static const char* op_names[] = {
+#define NUFS_OP_NAME(name) #name,
+    NUFS_OPS(NUFS_OP_NAME)
+#undef NUFS_OP_NAME
+};
+
+static op_stats ops[NUFS_OP_COUNT];
+nufs_counters stats_counters;
+
+uint64_t
+stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bucket(uint64_t ns)
+{
+    if (ns < SUB_COUNT) {
+        return ns;
+    }
+    int mag = 63 - __builtin_clzll(ns);
+    if (mag > MAX_MAG) {
+        return BUCKETS - 1;
+    }
+    return (mag - SUB_BITS + 1) * SUB_COUNT + ((ns >> (mag - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// the largest value that lands in the bucket
+static uint64_t
+bucket_top(int bb)
+{
+    if (bb < SUB_COUNT) {
+        return bb;
+    }
+    int mag = bb / SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = SUB_COUNT + bb % SUB_COUNT;
+    return ((sub + 1) << (mag - SUB_BITS)) - 1;
+}
+
+// records a callback that started at start and returned rv
+void
+stats_op(int op, uint64_t start, int rv, long bytes)
+{
+    uint64_t ns = stats_now() - start;
+    op_stats* st = &ops[op];
+    __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+    if (rv < 0) {
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+    }
+    else if (bytes > 0) {
+        __atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->hist[bucket(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t
+percentile(op_stats* st, uint64_t count, int per_mille)
+{
+    uint64_t want = (count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int bb = 0; bb < BUCKETS; ++bb) {
+        seen += __atomic_load_n(&st->hist[bb], __ATOMIC_RELAXED);
+        if (seen >= want) {
+            uint64_t top = bucket_top(bb);
+            return top < st->max_ns ? top : st->max_ns;
+        }
+    }
+    return st->max_ns;
+}
+
+// fills in stats, the caller holds the storage lock so the free counts
+// are from one moment
+void
+stats_get(nufs_stats* stats)
+{
+    memset(stats, 0, sizeof(nufs_stats));
+    for (int op = 0; op < NUFS_OP_COUNT; ++op) {
+        op_stats* st = &ops[op];
+        nufs_op_stats* out = &stats->ops[op];
+        out->count = __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+        out->errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+        out->bytes = __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+        out->total_ns = __atomic_load_n(&st->total_ns, __ATOMIC_RELAXED);
+        out->max_ns = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+        if (out->count > 0) {
+            out->p50_ns = percentile(st, out->count, 500);
+            out->p90_ns = percentile(st, out->count, 900);
+            out->p99_ns = percentile(st, out->count, 990);
+        }
+    }
+    memcpy(&stats->counters, &stats_counters, sizeof(nufs_counters));
+
+    uint8_t* pbm = get_pages_bitmap();
+    uint64_t used = 0;
+    for (int ii = 0; ii < PAGE_COUNT / 8; ++ii) {
+        used += __builtin_popcount(pbm[ii]);
+    }
+    stats->pages_free = PAGE_COUNT - used;
+    stats->inodes_free = get_super()->free_inodes;
+}
+
+// writes the stats as text, one callback per line and then one counter
+// per line, returns the length
+int
+stats_render(char* buf, int size)
+{
+    nufs_stats stats;
+    stats_get(&stats);
+    nufs_counters* cc = &stats.counters;
+
+    int len = snprintf(buf, size, "# op count errors bytes avg_ns p50_ns p90_ns p99_ns max_ns\n");
+    for (int op = 0; op < NUFS_OP_COUNT && len < size; ++op) {
+        nufs_op_stats* st = &stats.ops[op];
+        len += snprintf(buf + len, size - len, "%s %lu %lu %lu %lu %lu %lu %lu %lu\n",
+                        op_names[op], st->count, st->errors, st->bytes,
+                        st->count ? st->total_ns / st->count : 0,
+                        st->p50_ns, st->p90_ns, st->p99_ns, st->max_ns);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len,
+                        "pages_allocated %lu\npages_freed %lu\npages_copied %lu\n"
+                        "pages_free %lu\ninodes_free %lu\n"
+                        "lookups %lu\nlookup_depth %lu\ndirent_hits %lu\ndirent_misses %lu\n",
+                        cc->pages_allocated, cc->pages_freed, cc->pages_copied,
+                        stats.pages_free, stats.inodes_free,
+                        cc->lookups, cc->lookup_depth, cc->dirent_hits, cc->dirent_misses);
+    }
+    return len < size ? len : size - 1;
+}
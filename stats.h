@@ -0,0 +1,22 @@
+// counters and latency histograms, read through /.nufs-stats and
+// NUFS_IOC_STATS
+
+#ifndef NUFS_STATS_H
+#define NUFS_STATS_H
+
+#include <stdint.h>
+
+#include "nufs_ioctl.h"
+
+extern nufs_counters stats_counters;
+
+// bumps one of the nufs_counters, from any thread
+#define stats_count(name, n) \
+    __atomic_fetch_add(&stats_counters.name, (n), __ATOMIC_RELAXED)
+
+uint64_t stats_now();
+void     stats_op(int op, uint64_t start, int rv, long bytes);
+void     stats_get(nufs_stats* stats);
+int      stats_render(char* buf, int size);
+
+#endif
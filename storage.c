@@ -7,36 +7,212 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include "slist.h"
+#include "storage.h"
 #include "pages.h"
 #include "directory.h"
 #include "inode.h"
 #include "bitmap.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "compress.h"
 #include "util.h"
+#include "log.h"
+
+// set when a snapshot is mounted, every change is refused with EROFS
+static int storage_readonly = 0;
+// set to share identical pages as they are written
+static int storage_dedup = 0;
+
+// held for every call from the FUSE side and by the scrubber, one at a time
+static pthread_mutex_t storage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// when access times are updated, see storage_set_atime
+static int storage_atime = STORAGE_RELATIME;
+
+// While lazytime is on, changes to nothing but an inode's times wait here,
+// one entry per inode, instead of dirtying the inode table. An entry only
+// counts for the generation of the inode it was made for, so a reused
+// inode number doesn't get the old file's times.
+typedef struct lazy_times {
+    uint32_t gen;
+    int64_t  tim[3]; // by TIME_*, 0 if unchanged
+} lazy_times;
+
+static lazy_times* storage_lazy = 0;
+static int storage_lazy_dirty = 0; // some entry has times to write back
+
+#define TIME_A 0
+#define TIME_M 1
+#define TIME_C 2
+#define DAY_NS (24 * 3600 * 1000000000LL)
 
 // declaring helpers
-static void storage_update_time(inode* dd, time_t newa, time_t newm);
+static void storage_update_time(inode* dd, const struct timespec ts[2]);
 static void get_parent_child(const char* path, char* parent, char* child);
 
-// initializes our file structure
-void
+// initializes our file structure, a new image is formatted with the
+// defaults. Returns 0 or a negative errno.
+int
 storage_init(const char* path) {
-    // initialize the pages
-    pages_init(path);
-    // allocate a page for the inode list
-    if (!bitmap_get(get_pages_bitmap(), 1)) {
-        for (int i = 0; i < 3; i++) {
-            int newpage = alloc_page();
-            printf("second inode page allocated at page %d\n", newpage);
-        }
+    int rv = pages_init(path);
+    if (rv < 0) {
+        return rv;
     }
     // the remaining pages will be alloced when we put data in them
 
     // then we initialize the root directory if it isn't allocated
-    if (!bitmap_get(get_pages_bitmap(), 4)) {
-        printf("initializing root directory");
+    if (!bitmap_get(get_inode_bitmap(), 0)) {
+        log_info("initializing root directory\n");
         directory_init();
     }
+
+    dedup_init();
+    return 0;
+}
+
+// opens an existing image, returns 0 or a negative errno
+int
+storage_open(const char* path, int writable) {
+    int rv = pages_open(path, writable);
+    if (rv < 0) {
+        return rv;
+    }
+    if (!bitmap_get(get_inode_bitmap(), 0)) {
+        directory_init();
+    }
+    dedup_init();
+    storage_readonly = !writable;
+    return 0;
+}
+
+// writes back and unmaps the image, another one can be opened after
+void
+storage_close() {
+    storage_sync();
+    free(storage_lazy);
+    storage_lazy = 0;
+    storage_atime = STORAGE_RELATIME;
+    dedup_free();
+    compress_forget();
+    inode_use_table(NULL);
+    storage_readonly = 0;
+    pages_free();
+}
+
+// whoever takes the lock may change the metadata, see pages_unseal
+void
+storage_lock() {
+    pthread_mutex_lock(&storage_mutex);
+    pages_unseal();
+}
+
+// for the scrubber, which changes nothing the metadata checksums cover
+void
+storage_lock_scrub() {
+    pthread_mutex_lock(&storage_mutex);
+}
+
+void
+storage_unlock() {
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+void
+storage_set_dedup(int on) {
+    storage_dedup = on;
+}
+
+// sets when access times are updated, a STORAGE_*ATIME, and whether
+// timestamp-only changes are kept in memory until storage_sync
+void
+storage_set_atime(int mode, int lazytime) {
+    storage_atime = mode;
+    if (lazytime && !storage_lazy) {
+        storage_lazy = calloc(INODE_COUNT, sizeof(lazy_times));
+    }
+}
+
+static int64_t*
+node_time(inode* node, int which) {
+    return which == TIME_A ? &node->atim : which == TIME_M ? &node->mtim : &node->ctim;
+}
+
+// one of the node's times, with what lazytime hasn't written back
+static int64_t
+storage_time(inode* node, int which) {
+    if (storage_lazy && !storage_readonly) {
+        lazy_times* lt = &storage_lazy[node - get_inode(0)];
+        if (lt->gen == node->gen && lt->tim[which]) {
+            return lt->tim[which];
+        }
+    }
+    return *node_time(node, which);
+}
+
+// sets one of the node's times, in memory if lazy and lazytime is on
+static void
+storage_stamp(inode* node, int which, int64_t ns, int lazy) {
+    if (storage_lazy) {
+        lazy_times* lt = &storage_lazy[node - get_inode(0)];
+        if (lt->gen != node->gen) {
+            memset(lt, 0, sizeof(lazy_times));
+            lt->gen = node->gen;
+        }
+        if (lazy) {
+            lt->tim[which] = ns;
+            storage_lazy_dirty = 1;
+            return;
+        }
+        lt->tim[which] = 0;
+    }
+    *node_time(node, which) = ns;
+}
+
+// an access to the node's data, relatime skips it unless the last one
+// was before the last change or a day ago
+static void
+storage_touch(inode* node) {
+    if (storage_readonly || storage_atime == STORAGE_NOATIME) {
+        return;
+    }
+    int64_t now = inode_now();
+    if (storage_atime == STORAGE_RELATIME) {
+        int64_t atim = storage_time(node, TIME_A);
+        if (atim > storage_time(node, TIME_M) && atim > storage_time(node, TIME_C)
+            && now - atim < DAY_NS) {
+            return;
+        }
+    }
+    storage_stamp(node, TIME_A, now, 1);
+}
+
+// writes the times lazytime kept in memory into the inode table
+static void
+storage_flush_times() {
+    if (!storage_lazy_dirty || storage_readonly) {
+        return;
+    }
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        lazy_times* lt = &storage_lazy[ii];
+        inode* node = get_inode(ii);
+        for (int which = TIME_A; which <= TIME_C; ++which) {
+            if (lt->tim[which] && lt->gen == node->gen && node->refs > 0) {
+                *node_time(node, which) = lt->tim[which];
+            }
+            lt->tim[which] = 0;
+        }
+    }
+    storage_lazy_dirty = 0;
+}
+
+// writes everything back to the image file, for fsync and unmount
+int
+storage_sync() {
+    storage_flush_times();
+    return pages_sync();
 }
 
 // check to see if the file is available, if not returns -ENOENT
@@ -45,60 +221,161 @@ storage_access(const char* path) {
 
     int rv = tree_lookup(path);
     if (rv >= 0) {
-        inode* node = get_inode(rv);
-        time_t curtime = time(NULL);
-        node->atim = curtime;
+        storage_touch(get_inode(rv));
         return 0;
     }
     else
         return -ENOENT;
 }
 
+static void
+storage_fill_stat(inode* node, struct stat* st) {
+    st->st_mode = node->mode & ~INODE_FLAGS;
+    st->st_size = node->size;
+    st->st_blksize = PAGE_BYTES;
+    st->st_atim = inode_timespec(storage_time(node, TIME_A));
+    st->st_mtim = inode_timespec(storage_time(node, TIME_M));
+    st->st_ctim = inode_timespec(storage_time(node, TIME_C));
+    st->st_nlink = node->refs;
+}
+
+// the inode number of the path, or -ENOENT
+int
+storage_lookup(const char* path) {
+    int inum = tree_lookup(path);
+    return inum >= 0 ? inum : -ENOENT;
+}
+
+// an inode number that is in use, in the live table or a mounted snapshot
+static int
+storage_valid_inum(int inum) {
+    return inum >= 0 && inum < INODE_COUNT && get_inode(inum)->refs > 0;
+}
+
 // mutates the stat with the inode features at the path
 int 
 storage_stat(const char* path, struct stat* st) {
     int working_inum = tree_lookup(path);
-    if (working_inum > 0) {
-        inode* node = get_inode(working_inum);
-        st->st_mode = node->mode;
-        st->st_size = node->size;
-        st->st_atime = node->atim;
-        st->st_mtime = node->mtim;
-        st->st_ctime = node->ctim;
-        st->st_nlink = node->refs;
+    if (working_inum >= 0) {
+        storage_fill_stat(get_inode(working_inum), st);
         return 0;
     }
-    return -1;
+    return -ENOENT;
 }
 
-int 
+int
+storage_stat_inode(int inum, struct stat* st) {
+    if (!storage_valid_inum(inum)) {
+        return -ENOENT;
+    }
+    storage_fill_stat(get_inode(inum), st);
+    st->st_ino = inum;
+    return 0;
+}
+
+int
 storage_truncate(const char *path, off_t size) {
     int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    return storage_truncate_inode(inum, size);
+}
+
+int
+storage_truncate_inode(int inum, off_t size) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    if (!storage_valid_inum(inum)) {
+        return -ENOENT;
+    }
     inode* node = get_inode(inum);
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size / PAGE_BYTES >= INODE_MAX_PAGES) {
+        return -EFBIG;
+    }
+    int64_t now = inode_now();
+    storage_stamp(node, TIME_M, now, 0);
+    storage_stamp(node, TIME_C, now, 0);
+    int rv;
     if (node->size < size) {
-	grow_inode(node, size);
+	rv = grow_inode(node, size);
     } else {
-	shrink_inode(node, size);
+        // a compressed cluster can't be cut in half
+        if (compress_expand(node, size / PAGE_BYTES) < 0) {
+            return -ENOSPC;
+        }
+	rv = shrink_inode(node, size);
     }
-    return 0;
+    return (rv < 0) ? -ENOSPC : 0;
 }
 
-int 
+int
 storage_write(const char* path, const char* buf, size_t size, off_t offset)
 {
-    // get the start point with the path
-    inode* write_node = get_inode(tree_lookup(path));
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    return storage_write_inode(inum, buf, size, offset);
+}
+
+int
+storage_write_inode(int inum, const char* buf, size_t size, off_t offset)
+{
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    if (!storage_valid_inum(inum)) {
+        return -ENOENT;
+    }
+    inode* write_node = get_inode(inum);
+    // a new mtime is how a reopen through the kernel's cache (auto_cache)
+    // finds out the data changed
+    int64_t now = inode_now();
+    storage_stamp(write_node, TIME_M, now, 1);
+    storage_stamp(write_node, TIME_C, now, 1);
+    // the count has to fit what we return, a short write is allowed
+    if (size > INT_MAX) {
+        size = INT_MAX;
+    }
     if (write_node->size < size + offset) {
-        storage_truncate(path, size + offset);
+        int rv = storage_truncate_inode(inum, size + offset);
+        if (rv < 0) {
+            return rv;
+        }
     }
     int bindex = 0;
-    int nindex = offset;
+    off_t nindex = offset;
     int rem = size;
     while (rem > 0) {
-        char* dest = pages_get_page(inode_get_pnum(write_node, nindex));
-        dest += nindex % 4096;
-        int cpyamnt = min(rem, 4096 - (nindex % 4096));
+        int cpyamnt = min(rem, PAGE_BYTES - (nindex % PAGE_BYTES));
+        if (compress_expand(write_node, nindex / PAGE_BYTES) < 0) {
+            return bindex > 0 ? bindex : -ENOSPC;
+        }
+        if (storage_dedup && cpyamnt == PAGE_BYTES) {
+            if (dedup_write_page(write_node, nindex / PAGE_BYTES, buf + bindex) < 0) {
+                return bindex > 0 ? bindex : -ENOSPC;
+            }
+            bindex += cpyamnt;
+            nindex += cpyamnt;
+            rem -= cpyamnt;
+            continue;
+        }
+
+        // pages shared with a snapshot get copied before we write them
+        int pnum = inode_write_pnum(write_node, nindex);
+        if (pnum < 0) {
+            return bindex > 0 ? bindex : -ENOSPC;
+        }
+        dedup_forget(pnum);
+        char* dest = pages_get_page(pnum);
+        dest += nindex % PAGE_BYTES;
         memcpy(dest, buf + bindex, cpyamnt);
+        page_written(pnum);
         bindex += cpyamnt;
         nindex += cpyamnt;
         rem -= cpyamnt;
@@ -109,15 +386,53 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
 int
 storage_read(const char* path, char* buf, size_t size, off_t offset)
 {
-    printf("storage_read called, buffer is\n%s\n", buf);
-    inode* node = get_inode(tree_lookup(path));
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    return storage_read_inode(inum, buf, size, offset);
+}
+
+int
+storage_read_inode(int inum, char* buf, size_t size, off_t offset)
+{
+    if (!storage_valid_inum(inum)) {
+        return -ENOENT;
+    }
+    inode* node = get_inode(inum);
+    storage_touch(node);
+    // with direct_io the kernel doesn't stop reads at the end of the file
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (size > node->size - offset) {
+        size = node->size - offset;
+    }
+    if (size > INT_MAX) {
+        size = INT_MAX;
+    }
     int bindex = 0;
-    int nindex = offset;
+    off_t nindex = offset;
     int rem = size;
     while (rem > 0) {
-        char* src = pages_get_page(inode_get_pnum(node, nindex));
-        src += nindex % 4096;
-        int cpyamnt = min(rem, 4096 - (nindex % 4096));
+        static const char zeros[MAX_PAGE_BYTES];
+        int ptr = inode_get_pnum(node, nindex);
+        const char* src = pages_get_page(ptr);
+        if (ptr == 0) {
+            // not written yet
+            src = zeros;
+        }
+        else if (ptr & PTR_Z) {
+            src = compress_read(node, nindex / PAGE_BYTES);
+            if (src == NULL) {
+                return -EIO;
+            }
+        }
+        else if (page_verify(ptr) < 0) {
+            return -EIO;
+        }
+        src += nindex % PAGE_BYTES;
+        int cpyamnt = min(rem, PAGE_BYTES - (nindex % PAGE_BYTES));
         memcpy(buf + bindex, src, cpyamnt);
         bindex += cpyamnt;
         nindex += cpyamnt;
@@ -126,8 +441,72 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
     return size;
 }
 
+// drops the image pages under a range of the file from memory, for files
+// the kernel doesn't cache (direct_io) so their data isn't cached by us
+// instead
+int
+storage_forget(const char* path, off_t offset, size_t size) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode* node = get_inode(inum);
+    // runs of pages next to each other on the image go at once
+    int first = 0;
+    int count = 0;
+    off_t end = offset + size < node->size ? offset + size : node->size;
+    for (off_t off = offset - offset % PAGE_BYTES; off < end; off += PAGE_BYTES) {
+        int ptr = inode_get_pnum(node, off);
+        int plain = ptr != 0 && !(ptr & PTR_Z);
+        if (plain && count > 0 && ptr == first + count) {
+            count += 1;
+            continue;
+        }
+        if (count > 0) {
+            pages_forget(first, count);
+        }
+        first = ptr;
+        count = plain;
+    }
+    if (count > 0) {
+        pages_forget(first, count);
+    }
+    return 0;
+}
+
+// makes a new inode of the given mode and puts it in directory pnodenum
+// as name. slot is passed on to directory_put_next.
+static int
+storage_make(int pnodenum, const char* name, int mode, int* slot) {
+    int new_inode = alloc_inode();
+    if (new_inode < 0) {
+        return -ENOSPC;
+    }
+    inode* node = get_inode(new_inode);
+    inode* parent_dir = get_inode(pnodenum);
+    // files inherit compression from their directory
+    node->mode = mode | (parent_dir->mode & INODE_COMPRESS);
+    node->size = 0;
+    node->refs = 1;
+
+    // directories remember their parent so a rename can repoint it
+    if (S_ISDIR(mode) && directory_put(node, "..", pnodenum) < 0) {
+        decrease_refs(new_inode);
+        return -ENOSPC;
+    }
+
+    int rv = directory_put_next(parent_dir, name, new_inode, slot);
+    if (rv < 0) {
+        decrease_refs(new_inode);
+    }
+    return rv;
+}
+
 int
 storage_mknod(const char* path, int mode) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
     // should add a direntry of the correct mode to the
     // directory at the path
         
@@ -136,27 +515,104 @@ storage_mknod(const char* path, int mode) {
         return -EEXIST;
     }
  
-    char* item = malloc(50);
+    char* item = malloc(strlen(path) + 1);
     char* parent = malloc(strlen(path));
     get_parent_child(path, parent, item);
 
     int    pnodenum = tree_lookup(parent);
-    if (pnodenum < 0) {
-        free(item);
-        free(parent);   
-        return -ENOENT;
+    int rv = -ENOENT;
+    if (pnodenum >= 0) {
+        int slot = 0;
+        rv = storage_make(pnodenum, item, mode, &slot);
     }
-    
-    int new_inode = alloc_inode();
-    inode* node = get_inode(new_inode);
-    node->mode = mode;
-    node->size = 0;
-    node->refs = 1;
-    inode* parent_dir = get_inode(pnodenum);
-
-    directory_put(parent_dir, item, new_inode);
     free(item);
     free(parent);
+    return rv;
+}
+
+// gets the directory at path for a batch, or -errno
+static int
+storage_bulk_dir(const char* path) {
+    int dnum = tree_lookup(path);
+    if (dnum < 0) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(get_inode(dnum)->mode)) {
+        return -ENOTDIR;
+    }
+    return dnum;
+}
+
+// makes an entry of the given mode in the directory at path for each of
+// count names. results[ii] gets 0 or -errno for names[ii]; a name that is
+// taken, or comes twice, gets -EEXIST. The directory is found and scanned
+// for the names once for the whole batch, and the new entries fill its
+// free slots in order. Returns how many were made.
+int
+storage_bulk_create(const char* path, const char** names, int count, int mode,
+                    int* results) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    int dnum = storage_bulk_dir(path);
+    if (dnum < 0) {
+        return dnum;
+    }
+    if (!S_ISREG(mode) && !S_ISDIR(mode)) {
+        return -EINVAL;
+    }
+    int* inums = malloc(count * sizeof(int));
+    directory_lookup_many(get_inode(dnum), names, count, inums);
+
+    int made = 0;
+    int slot = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        const char* name = names[ii];
+        if (name[0] == 0 || strchr(name, '/') || streq(name, ".")) {
+            results[ii] = -EINVAL;
+        }
+        else if (strlen(name) >= DIR_NAME) {
+            results[ii] = -ENAMETOOLONG;
+        }
+        else if (inums[ii] >= 0) {
+            results[ii] = -EEXIST;
+        }
+        else {
+            results[ii] = storage_make(dnum, name, mode, &slot);
+        }
+        if (results[ii] == 0) {
+            made += 1;
+            // so a later copy of the name finds it taken
+            for (int jj = ii + 1; jj < count; ++jj) {
+                if (inums[jj] < 0 && streq(names[jj], name)) {
+                    inums[jj] = 0;
+                }
+            }
+        }
+    }
+    free(inums);
+    log_debug("+ bulk_create(%s, %d) -> %d\n", path, count, made);
+    return made;
+}
+
+// stats count names in the directory at path at once. results[ii] gets
+// 0 and sts[ii] is filled in, or -ENOENT.
+int
+storage_bulk_stat(const char* path, const char** names, int count, struct stat* sts,
+                  int* results) {
+    int dnum = storage_bulk_dir(path);
+    if (dnum < 0) {
+        return dnum;
+    }
+    int* inums = malloc(count * sizeof(int));
+    directory_lookup_many(get_inode(dnum), names, count, inums);
+    for (int ii = 0; ii < count; ++ii) {
+        results[ii] = inums[ii] >= 0 ? 0 : -ENOENT;
+        if (inums[ii] >= 0) {
+            storage_fill_stat(get_inode(inums[ii]), &sts[ii]);
+        }
+    }
+    free(inums);
     return 0;
 }
 
@@ -164,12 +620,18 @@ storage_mknod(const char* path, int mode) {
 // delete the inode associated with the dirent
 int
 storage_unlink(const char* path) {
-    char* nodename = malloc(50);
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    char* nodename = malloc(strlen(path) + 1);
     char* parentpath = malloc(strlen(path));
     get_parent_child(path, parentpath, nodename);
 
-    inode* parent = get_inode(tree_lookup(parentpath));
-    int rv = directory_delete(parent, nodename);
+    int pnum = tree_lookup(parentpath);
+    int rv = -ENOENT;
+    if (pnum >= 0) {
+        rv = directory_delete(get_inode(pnum), nodename);
+    }
 
     free(parentpath);
     free(nodename);
@@ -179,22 +641,34 @@ storage_unlink(const char* path) {
 
 int    
 storage_link(const char *from, const char *to) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
     int tnum = tree_lookup(to);
     if (tnum < 0) {
-        return tnum;
+        return -ENOENT;
+    }
+    if (tree_lookup(from) != -1) {
+        return -EEXIST;
     }
 
-    char* fname = malloc(50);
+    char* fname = malloc(strlen(from) + 1);
     char* fparent = malloc(strlen(from));
     get_parent_child(from, fparent, fname);
 
-    inode* pnode = get_inode(tree_lookup(fparent));
-    directory_put(pnode, fname, tnum);
-    get_inode(tnum)->refs ++;
+    int pnum = tree_lookup(fparent);
+    int rv = -ENOENT;
+    if (pnum >= 0) {
+        rv = directory_put(get_inode(pnum), fname, tnum);
+    }
+    // the target only gains a link once its entry is in
+    if (rv == 0) {
+        get_inode(tnum)->refs ++;
+    }
     
     free(fname);
     free(fparent);
-    return 0;
+    return rv;
 }
 
 int
@@ -207,39 +681,353 @@ storage_symlink(const char* to, const char* from) {
     return 0;
 }
 
+// reads the target of a symlink into buf as a string, cut short if it
+// doesn't fit
 int
 storage_readlink(const char* path, char* buf, size_t size) {
-    return storage_read(path, buf, size, 0);
+    if (size == 0) {
+        return -EINVAL;
+    }
+    int rv = storage_read(path, buf, size - 1, 0);
+    if (rv < 0) {
+        return rv;
+    }
+    buf[rv] = 0;
+    return 0;
 }
 
+// renames in one pass over the two parent directories: the source entry is
+// renamed in place or moved, and an existing target is replaced by
+// repointing its entry, so the target name never disappears
 int    
 storage_rename(const char *from, const char *to) {
-    storage_link(to, from);
-    storage_unlink(from);
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    if (streq(from, to)) {
+        return 0;
+    }
+
+    char fparent[strlen(from) + 1];
+    char fname[strlen(from) + 1];
+    char tparent[strlen(to) + 1];
+    char tname[strlen(to) + 1];
+    get_parent_child(from, fparent, fname);
+    get_parent_child(to, tparent, tname);
+
+    int fpnum = tree_lookup(fparent);
+    int tpnum = tree_lookup(tparent);
+    if (fpnum < 0 || tpnum < 0) {
+        return -ENOENT;
+    }
+    inode* fdir = get_inode(fpnum);
+    inode* tdir = get_inode(tpnum);
+
+    int snum = directory_lookup(fdir, fname);
+    if (snum < 0) {
+        return -ENOENT;
+    }
+    int isdir = S_ISDIR(get_inode(snum)->mode);
+
+    // a directory can't be moved underneath itself
+    int flen = strlen(from);
+    if (isdir && strncmp(from, to, flen) == 0 && to[flen] == '/') {
+        return -EINVAL;
+    }
+
+    int tnum = directory_lookup(tdir, tname);
+    if (tnum == snum) {
+        // both names are links to the same inode, nothing to do
+        return 0;
+    }
+
+    if (tnum >= 0) {
+        inode* target = get_inode(tnum);
+        if (isdir && !S_ISDIR(target->mode)) {
+            return -ENOTDIR;
+        }
+        if (!isdir && S_ISDIR(target->mode)) {
+            return -EISDIR;
+        }
+        if (S_ISDIR(target->mode) && !directory_empty(target)) {
+            return -ENOTEMPTY;
+        }
+        directory_set(tdir, tname, snum);
+        directory_detach(fdir, fname);
+        decrease_refs(tnum);
+    }
+    else if (fpnum == tpnum) {
+        int rv = directory_rename(fdir, fname, tname);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    else {
+        int rv = directory_put(tdir, tname, snum);
+        if (rv < 0) {
+            return rv;
+        }
+        directory_detach(fdir, fname);
+    }
+
+    if (isdir && fpnum != tpnum) {
+        directory_set(get_inode(snum), "..", tpnum);
+    }
     return 0;
 }
 
 int    
 storage_set_time(const char* path, const struct timespec ts[2])
 {
+    if (storage_readonly) {
+        return -EROFS;
+    }
     int nodenum = tree_lookup(path);
     if (nodenum < 0) {
         return -ENOENT;
     }
     inode* node = get_inode(nodenum);
-    storage_update_time(node, ts[0].tv_sec, ts[1].tv_sec);
+    storage_update_time(node, ts);
     return 0;
 }
 
 static
-void storage_update_time(inode* dd, time_t newa, time_t newm)
+void storage_update_time(inode* dd, const struct timespec ts[2])
 {
-    dd->atim = newa;
-    dd->mtim = newm;
+    int64_t curtime = inode_now();
+    if (ts[0].tv_nsec != UTIME_OMIT) {
+        storage_stamp(dd, TIME_A, ts[0].tv_nsec == UTIME_NOW ? curtime : inode_time(&ts[0]), 0);
+    }
+    if (ts[1].tv_nsec != UTIME_OMIT) {
+        storage_stamp(dd, TIME_M, ts[1].tv_nsec == UTIME_NOW ? curtime : inode_time(&ts[1]), 0);
+    }
+}
+
+typedef struct readdir_state {
+    storage_filler fill;
+    void*          buf;
+} readdir_state;
+
+static int
+storage_readdir_entry(dirent* entry, int slot, void* arg) {
+    readdir_state* state = arg;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    storage_fill_stat(get_inode(entry->inum), &st);
+    return state->fill(state->buf, entry->name, &st, slot + 2);
 }
 
-slist* storage_list(const char* path) {
-    return directory_list(path);
+// lists the directory at path from cookie on, with the attributes of each
+// entry straight from its inode. Cookie 0 is the start, "." comes first
+// and then the entry in slot ii carries cookie ii + 2 (the one to pass to
+// carry on after it), so picking a listing back up costs nothing.
+int
+storage_readdir(const char* path, off_t cookie, storage_filler fill, void* buf) {
+    int dnum = tree_lookup(path);
+    if (dnum < 0) {
+        return -ENOENT;
+    }
+    inode* dd = get_inode(dnum);
+    if (!S_ISDIR(dd->mode)) {
+        return -ENOTDIR;
+    }
+    if (cookie == 0) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        storage_fill_stat(dd, &st);
+        if (fill(buf, ".", &st, 1)) {
+            return 0;
+        }
+        cookie = 1;
+    }
+    readdir_state state = { fill, buf };
+    directory_walk(dd, cookie - 1, storage_readdir_entry, &state);
+    return 0;
+}
+
+// makes to share from's data pages, like FICLONE/FICLONERANGE. Offsets
+// must be page aligned and so must the length, unless the range runs to
+// the end of from. A length of 0 clones everything from src_off on.
+int
+storage_clone(const char* from, const char* to, off_t src_off, off_t len, off_t dst_off) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    int snum = tree_lookup(from);
+    int dnum = tree_lookup(to);
+    if (snum < 0 || dnum < 0) {
+        return -ENOENT;
+    }
+    inode* src = get_inode(snum);
+    inode* dst = get_inode(dnum);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) {
+        return -EISDIR;
+    }
+    if (snum == dnum || src_off < 0 || len < 0 || dst_off < 0 || src_off > src->size) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        len = src->size - src_off;
+    }
+    if (src_off + len > src->size) {
+        return -EINVAL;
+    }
+    if ((dst_off + len) / PAGE_BYTES >= INODE_MAX_PAGES) {
+        return -EFBIG;
+    }
+
+    int64_t curtime = inode_now();
+    storage_stamp(dst, TIME_M, curtime, 0);
+    storage_stamp(dst, TIME_C, curtime, 0);
+
+    // the whole file is just its pointers, unless one of them is shared
+    // too widely and the pages have to be gone through one by one
+    if (src_off == 0 && dst_off == 0 && len == src->size && len >= dst->size
+        && inode_clone(src, dst) == 0) {
+        return 0;
+    }
+
+    int tail = src_off + len == src->size;
+    if (src_off % PAGE_BYTES || dst_off % PAGE_BYTES || (len % PAGE_BYTES && !tail)) {
+        return -EINVAL;
+    }
+    // a partial last page would clobber what follows it in to
+    if (len % PAGE_BYTES && dst_off + len < dst->size) {
+        return -EINVAL;
+    }
+    // pages are shared one by one, so no compressed clusters in the way
+    for (int ii = 0; ii < bytes_to_pages(len); ii += 1) {
+        if (compress_expand(src, src_off / PAGE_BYTES + ii) < 0
+            || (dst_off + ii * PAGE_BYTES <= dst->size
+                && compress_expand(dst, dst_off / PAGE_BYTES + ii) < 0)) {
+            return -ENOSPC;
+        }
+    }
+    int rv = inode_clone_range(src, src_off / PAGE_BYTES, dst, dst_off / PAGE_BYTES,
+                               bytes_to_pages(len));
+    if (rv < 0) {
+        return -ENOSPC;
+    }
+    if (dst->size < dst_off + len) {
+        dst->size = dst_off + len;
+    }
+    return 0;
+}
+
+// compresses the file's data if it is marked for compression, which it
+// is when it or its directory has the compress flag
+int
+storage_compress(const char* path) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode* node = get_inode(inum);
+    if (storage_readonly || !(node->mode & INODE_COMPRESS) || S_ISDIR(node->mode)) {
+        return 0;
+    }
+    return compress_inode(node);
+}
+
+// gets the INODE_* flags of the file
+int
+storage_get_flags(const char* path) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    return get_inode(inum)->mode & INODE_FLAGS;
+}
+
+// the generation of the file's inode, which tells apart files that
+// got the same inode number at different times
+int
+storage_get_version(const char* path, long* gen) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    *gen = get_inode(inum)->gen;
+    return 0;
+}
+
+int
+storage_set_flags(const char* path, int flags) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    inode* node = get_inode(inum);
+    node->mode = (node->mode & ~INODE_COMPRESS) | (flags & INODE_COMPRESS);
+    storage_stamp(node, TIME_C, inode_now(), 0);
+    return 0;
+}
+
+// shares identical pages across all files, returns how many pages that freed
+int
+storage_dedup_all() {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    return dedup_all();
+}
+
+int
+storage_dedup_stats(long* written, long* shared, long* hash_ns, long* lookup_ns) {
+    dedup_stats* stats = get_dedup_stats();
+    *written = stats->pages_written;
+    *shared = stats->pages_shared;
+    *hash_ns = stats->hash_ns;
+    *lookup_ns = stats->lookup_ns;
+    return 0;
+}
+
+long
+storage_csum_errors() {
+    return pages_csum_errors();
+}
+
+int
+storage_snapshot_create() {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    // the snapshot gets the times as they are now
+    storage_flush_times();
+    return snapshot_create();
+}
+
+int
+storage_snapshot_delete(int id) {
+    if (storage_readonly) {
+        return -EROFS;
+    }
+    return snapshot_delete(id);
+}
+
+// fills in the creation time of each snapshot slot, 0 for free slots
+int
+storage_snapshot_list(time_t* ctims, int count) {
+    for (int ii = 0; ii < count && ii < SNAP_COUNT; ++ii) {
+        snapshot* snap = get_snapshot(ii);
+        ctims[ii] = snap->used ? *snapshot_ctim(snap) : 0;
+    }
+    return 0;
+}
+
+// serves the given snapshot instead of the live filesystem, read-only
+int
+storage_mount_snapshot(int id) {
+    inode* table = snapshot_load(id);
+    if (table == NULL) {
+        return -ENOENT;
+    }
+    inode_use_table(table);
+    storage_readonly = 1;
+    return 0;
 }
 
 static void get_parent_child(const char* path, char* parent, char* child) {
@@ -248,7 +1036,7 @@ static void get_parent_child(const char* path, char* parent, char* child) {
     parent[0] = 0;
     while (fdir->next != NULL) {
         strncat(parent, "/", 1);
-        strncat(parent, fdir->data, 48);
+        strcat(parent, fdir->data);
         fdir = fdir->next;
     }
     memcpy(child, fdir->data, strlen(fdir->data));
@@ -1,4 +1,10 @@
 // based on cs3650 starter code
+//
+// The API of libnufs: everything the FUSE front end (nufs.c) does to an
+// image goes through these, and other programs link libnufs.a or
+// libnufs.so to do the same in-process. One image is open at a time.
+// Calls return a negative errno on failure. The storage lock is only
+// needed when more than one thread makes calls.
 
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
@@ -10,19 +16,64 @@
 
 #include "slist.h"
 
-void   storage_init(const char* path);
+// when access times are updated
+#define STORAGE_STRICTATIME 0 // on every access
+#define STORAGE_RELATIME    1 // once after each change, or once a day
+#define STORAGE_NOATIME     2 // never
+
+// the same as fuse_fill_dir_t, returns 1 once the buffer is full
+typedef int (*storage_filler)(void* buf, const char* name, const struct stat* st, off_t next);
+
+// the image
+int    storage_init(const char* path);
+int    storage_open(const char* path, int writable);
+void   storage_close();
+int    storage_sync();
+void   storage_set_dedup(int on);
+void   storage_set_atime(int mode, int lazytime);
+void   storage_lock();
+void   storage_lock_scrub();
+void   storage_unlock();
+
+// by path
 int    storage_access(const char* path);
 int    storage_stat(const char* path, struct stat* st);
 int    storage_read(const char* path, char* buf, size_t size, off_t offset);
 int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
 int    storage_truncate(const char *path, off_t size);
 int    storage_mknod(const char* path, int mode); 
+int    storage_bulk_create(const char* path, const char** names, int count, int mode,
+                           int* results);
+int    storage_bulk_stat(const char* path, const char** names, int count, struct stat* sts,
+                         int* results);
 int    storage_unlink(const char* path);
 int    storage_link(const char *from, const char *to);
 int    storage_rename(const char *from, const char *to);
 int    storage_set_time(const char* path, const struct timespec ts[2]);
 int    storage_symlink(const char* to, const char* from);
 int    storage_readlink(const char* path, char* buf, size_t size);
-slist* storage_list(const char* path);
+int    storage_forget(const char* path, off_t offset, size_t size);
+int    storage_readdir(const char* path, off_t cookie, storage_filler fill, void* buf);
+
+// by inode number, from storage_lookup
+int    storage_lookup(const char* path);
+int    storage_stat_inode(int inum, struct stat* st);
+int    storage_read_inode(int inum, char* buf, size_t size, off_t offset);
+int    storage_write_inode(int inum, const char* buf, size_t size, off_t offset);
+int    storage_truncate_inode(int inum, off_t size);
+
+// nufs features, the ioctls of nufs_ioctl.h
+int    storage_clone(const char* from, const char* to, off_t src_off, off_t len, off_t dst_off);
+int    storage_compress(const char* path);
+int    storage_get_flags(const char* path);
+int    storage_set_flags(const char* path, int flags);
+int    storage_get_version(const char* path, long* gen);
+int    storage_dedup_all();
+int    storage_dedup_stats(long* written, long* shared, long* hash_ns, long* lookup_ns);
+long   storage_csum_errors();
+int    storage_snapshot_create();
+int    storage_snapshot_delete(int id);
+int    storage_snapshot_list(time_t* ctims, int count);
+int    storage_mount_snapshot(int id);
 
 #endif
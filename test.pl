@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 44;
 use IO::Handle;
 
 sub mount {
@@ -10,6 +10,13 @@ sub mount {
     sleep 1;
 }
 
+sub mount_with {
+    my ($opts, $image) = @_;
+    $image ||= "data.nufs";
+    system("(make mount OPTS='$opts' IMAGE='$image' 2>&1) >> test.log &");
+    sleep 1;
+}
+
 sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
@@ -159,6 +166,16 @@ write_text("dir1/dir2/dir3/dir4/dir5/hello.txt", $hi0);
 my $hi1 = read_text("dir1/dir2/dir3/dir4/dir5/hello.txt");
 ok($hi0 eq $hi1, "nested directories");
 
+write_text("tmp.txt", "new contents");
+write_text("dst.txt", "old contents");
+system("mv mnt/tmp.txt mnt/dst.txt");
+ok(read_text("dst.txt") eq "new contents" && !-e "mnt/tmp.txt",
+   "rename replaces an existing file");
+
+system("mv mnt/dir1 mnt/foo/dir1");
+my $hi2 = read_text("foo/dir1/dir2/dir3/dir4/dir5/hello.txt");
+ok($hi0 eq $hi2 && !-d "mnt/dir1", "moved a directory");
+
 system("mkdir mnt/numbers");
 for my $ii (1..50) {
     write_text("numbers/$ii.num", "$ii");
@@ -187,4 +204,152 @@ mount();
 my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
+system("mkdir mnt/many");
+system("seq 1 100 | ./nufsctl create mnt/many >> test.log 2>&1");
+my $many = `ls mnt/many | wc -l`;
+my $st = `./nufsctl stat mnt/many 1 100 2>&1`;
+ok($many == 100 && $st =~ /^100\t100644\t0\t1$/m,
+   "bulk create fills a directory past one page");
+
+my $long = "n" x 200;
+write_text($long, "long");
+ok(read_text($long) eq "long", "200 character file name");
+
+my $stats = `cat mnt/.nufs-stats`;
+ok($stats =~ /^write (\d+) 0 (\d+) /m && $1 > 0 && $2 > 0
+   && $stats =~ /^lookups [1-9]/m, "stats file counts writes and lookups");
+
 unmount();
+
+system("./fsck.nufs data.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the image clean");
+
+say "#           == Feature Tests ==";
+system("./mkfs.nufs -p 8192 data.nufs >> test.log 2>&1");
+mount_with("-o dedup");
+
+# 65 files of 1024 identical pages are more references to one page than
+# its 16 bit refcount holds
+my $page = "z" x 4096;
+for my $ii (0..64) {
+    open my $fh, ">", "mnt/same$ii" or last;
+    print $fh $page x 1024;
+    close $fh;
+}
+open my $fh, "+<", "mnt/same0";
+print $fh "X" x 4096;
+close $fh;
+ok(read_text_slice("same5", 4096, 0) eq $page
+   && read_text_slice("same64", 4096, 1023 * 4096) eq $page
+   && read_text_slice("same0", 4096, 0) eq "X" x 4096,
+   "writing through a heavily shared page leaves the others alone");
+system("rm -f mnt/same*");
+
+unmount();
+
+system("./fsck.nufs data.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the image clean after dedup");
+
+# the inode table has a checksum once the image is closed, this flips a
+# spare byte of inode 3
+open my $img, "+<", "data.nufs";
+binmode $img;
+read $img, my $sb, 64;
+seek $img, unpack("Q<", substr($sb, 48, 8)) + 128 * 3 + 60, 0;
+print $img "\x55";
+close $img;
+system("./fsck.nufs data.nufs >> test.log 2>&1");
+ok($? >> 8 == 4, "fsck catches a damaged inode table page");
+
+system("./mkfs.nufs -p 1024 data.nufs >> test.log 2>&1");
+mount();
+
+write_text("snapped", "before");
+my $snap = `./nufsctl snapshot mnt 2>> test.log`;
+chomp $snap;
+write_text("snapped", "after");
+
+write_text("orig", "original text");
+system("./nufsctl clone mnt/orig mnt/copy >> test.log 2>&1");
+open my $cfh, "+<", "mnt/copy";
+print $cfh "ORIGINAL";
+close $cfh;
+
+my $squeeze = "compress me please " x 20000;
+system("touch mnt/squeezed && chattr +c mnt/squeezed >> test.log 2>&1");
+write_text("squeezed", $squeeze);
+
+# pages 1 to 6 are never written
+system("touch mnt/sparse && chattr +c mnt/sparse >> test.log 2>&1");
+open my $sfh, "+<", "mnt/sparse";
+print $sfh "first page";
+seek $sfh, 7 * 4096, 0;
+print $sfh "last page";
+close $sfh;
+
+write_text("damaged", "checksummed " x 300);
+unmount();
+
+mount_with("-o snapshot=$snap");
+ok(read_text("snapped") eq "before", "a snapshot keeps what a file held when it was taken");
+unmount();
+
+# flip a byte of the file's page behind nufs' back
+open $img, "+<", "data.nufs";
+binmode $img;
+my $image = do { local $/ = undef; <$img> };
+seek $img, index($image, "checksummed checksummed") + 5, 0;
+print $img "X";
+close $img;
+mount();
+read_text("damaged");
+my $errors = `./nufsctl csum-errors mnt 2>> test.log`;
+ok($errors =~ /^[1-9]/, "csum-errors counts a page damaged on the image");
+
+# read back from the image, not the kernel's cache
+ok(read_text("orig") eq "original text" && read_text("copy") eq "ORIGINAL text",
+   "a clone stays independent after a write");
+my $attrs = `lsattr mnt/squeezed 2>> test.log`;
+ok($attrs =~ /^\S*c/ && read_text("squeezed") eq $squeeze,
+   "a compressed file reads back intact");
+ok(read_text_slice("sparse", 4096, 4096) eq "\0" x 4096
+   && read_text_slice("sparse", 9, 7 * 4096) eq "last page",
+   "a compressed sparse file reads zeros in its holes");
+unmount();
+
+# a read after the last change moves atime along unless noatime
+mount_with("-o noatime,cache=0");
+write_text("atime", "read me");
+utime(1000000000, 1000000000, "mnt/atime");
+unmount();
+mount_with("-o noatime,cache=0");
+read_text("atime");
+ok((stat("mnt/atime"))[8] == 1000000000, "noatime leaves atime alone on a read");
+unmount();
+
+# the kernel doesn't stop direct_io reads at the end of the file for us
+mount_with("-o direct=/*.raw");
+my $raw = "raw bytes " x 1230;
+write_text("big.raw", $raw);
+my $rawback = `cat mnt/big.raw`;
+ok($rawback eq "$raw\n" && read_text_slice("big.raw", 4096, 100 << 20) eq "",
+   "a direct_io read stops at the end of the file");
+unmount();
+
+# 64k stripes, 2MB in each file
+system("rm -f stripe1.nufs stripe2.nufs");
+system("./mkfs.nufs -p 1024 -s 65536 stripe1.nufs:stripe2.nufs >> test.log 2>&1");
+mount_with("", "stripe1.nufs:stripe2.nufs");
+my $striped = join("", map { chr(65 + $_ % 26) x 1000 } 0..299);
+write_text("striped", $striped);
+ok(read_text("striped") eq $striped && -s "stripe2.nufs" == 2097152,
+   "a file reads back from an image striped across two files");
+unmount();
+
+system("./fsck.nufs stripe1.nufs:stripe2.nufs >> test.log 2>&1");
+ok($? == 0, "fsck finds the striped image clean");
+
+truncate("stripe2.nufs", 65536);
+system("./fsck.nufs stripe1.nufs:stripe2.nufs >> test.log 2>&1");
+ok($? != 0 && ($? & 127) == 0, "fsck refuses a striped image with a short file");
+system("rm -f stripe1.nufs stripe2.nufs");
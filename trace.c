@@ -0,0 +1,216 @@
+// binary trace ring and recordings, see trace.h
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "nufs_ioctl.h"
+
+trace_rec* trace_ring = 0;
+static uint32_t trace_head = 0; // records ever put
+static char trace_path[NUFS_PATH_MAX];
+
+FILE* record_file = 0;
+static uint64_t record_epoch;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+trace_start(const char* path)
+{
+    if (strlen(path) >= sizeof(trace_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(trace_path, path);
+    trace_rec* ring = calloc(TRACE_RECORDS, sizeof(trace_rec));
+    if (ring == NULL) {
+        return -ENOMEM;
+    }
+    trace_head = 0;
+    __atomic_store_n(&trace_ring, ring, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+trace_stop()
+{
+    trace_rec* ring = trace_ring;
+    trace_ring = 0;
+    free(ring);
+}
+
+void
+trace_put(int event, int rv, int arg, int64_t off)
+{
+    uint64_t ns = mono_ns();
+    uint32_t pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_rec* rec = &trace_ring[pos & (TRACE_RECORDS - 1)];
+    // a dump that catches the record half written sees seq 0 and skips it
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    rec->ns = ns;
+    rec->event = event;
+    rec->rv = rv;
+    rec->arg = arg;
+    rec->off = off;
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int
+write_all(int fd, const void* buf, size_t size)
+{
+    const char* pp = buf;
+    while (size > 0) {
+        ssize_t done = write(fd, pp, size);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        pp += done;
+        size -= done;
+    }
+    return 0;
+}
+
+// writes the ring to the trace file, returns the records written. Only
+// open, write and close, so it is safe from a signal handler.
+int
+trace_dump()
+{
+    trace_rec* ring = trace_ring;
+    if (ring == 0) {
+        return -ENOTTY;
+    }
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+    uint32_t first = (head - count) & (TRACE_RECORDS - 1);
+
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    trace_header hdr = { TRACE_MAGIC, count, sizeof(trace_rec) };
+    uint32_t tail = count < TRACE_RECORDS - first ? count : TRACE_RECORDS - first;
+    int rv = write_all(fd, &hdr, sizeof(hdr));
+    if (rv == 0) {
+        rv = write_all(fd, ring + first, tail * sizeof(trace_rec));
+    }
+    if (rv == 0) {
+        rv = write_all(fd, ring, (count - tail) * sizeof(trace_rec));
+    }
+    close(fd);
+    return rv < 0 ? -EIO : (int)count;
+}
+
+// starts appending every call to the file at path
+int
+record_start(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return -errno;
+    }
+    // records are small, let them pile up rather than write each one
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    trace_header hdr = { RECORD_MAGIC, 0, sizeof(record_op) };
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+        fclose(file);
+        return -EIO;
+    }
+    record_epoch = mono_ns();
+    record_file = file;
+    return 0;
+}
+
+void
+record_stop()
+{
+    pthread_mutex_lock(&record_lock);
+    if (record_file) {
+        fclose(record_file);
+        record_file = 0;
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+void
+record_flush()
+{
+    pthread_mutex_lock(&record_lock);
+    if (record_file) {
+        fflush(record_file);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+// appends one call, start is its stats_now() time
+void
+record_put(int op, uint64_t start, int rv, const char* path, const char* path2,
+           int arg, int64_t off, int64_t off2)
+{
+    record_op rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ns = start > record_epoch ? start - record_epoch : 0;
+    rec.op = op;
+    rec.npaths = path2 ? 2 : 1;
+    rec.rv = rv;
+    rec.arg = arg;
+    rec.off = off;
+    rec.off2 = off2;
+    int len1 = strlen(path) + 1;
+    int len2 = path2 ? strlen(path2) + 1 : 0;
+    rec.len = len1 + len2;
+
+    pthread_mutex_lock(&record_lock);
+    if (record_file) {
+        fwrite(&rec, sizeof(rec), 1, record_file);
+        fwrite(path, len1, 1, record_file);
+        if (path2) {
+            fwrite(path2, len2, 1, record_file);
+        }
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+// a utimens time as ns since the epoch, UTIME_NOW and UTIME_OMIT as the
+// two lowest numbers, which no real time comes near
+int64_t
+record_time(const struct timespec* ts)
+{
+    if (ts->tv_nsec == UTIME_NOW || ts->tv_nsec == UTIME_OMIT) {
+        return INT64_MIN + (ts->tv_nsec == UTIME_OMIT);
+    }
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+struct timespec
+record_timespec(int64_t ns)
+{
+    struct timespec ts = { 0, 0 };
+    if (ns == INT64_MIN || ns == INT64_MIN + 1) {
+        ts.tv_nsec = ns == INT64_MIN ? UTIME_NOW : UTIME_OMIT;
+        return ts;
+    }
+    // rounds down for times before the epoch too
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec -= 1;
+        ts.tv_nsec += 1000000000LL;
+    }
+    return ts;
+}
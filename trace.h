@@ -0,0 +1,88 @@
+// binary trace of filesystem operations
+//
+// When tracing is on (nufs -o trace=<file>), each callback and page
+// operation drops a fixed-size record into a ring of the last
+// TRACE_RECORDS. Writers only bump a shared counter, so tracing never
+// takes a lock. The ring is written to the file on SIGUSR1, on
+// NUFS_IOC_TRACE_DUMP and at unmount, and nufsctl trace prints it.
+//
+// A recording (nufs -o record=<file>) is the other kind of trace: every
+// callback in the order they ran, with its paths, appended to the file
+// until unmount. nufs-replay runs one against an image.
+
+#ifndef NUFS_TRACE_H
+#define NUFS_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TRACE_RECORDS 65536 // a power of two
+#define TRACE_MAGIC   0x316372747366756eULL // "nufstrc1"
+#define RECORD_MAGIC  0x316365727366756eULL // "nufsrec1"
+
+#define TRACE_EVENTS(X) \
+    X(ACCESS) X(GETATTR) X(READDIR) X(MKNOD) X(MKDIR) X(UNLINK) X(LINK) \
+    X(RMDIR) X(RENAME) X(CHMOD) X(TRUNCATE) X(OPEN) X(RELEASE) X(READ)  \
+    X(WRITE) X(UTIMENS) X(IOCTL) X(SYMLINK) X(READLINK) X(FSYNC)        \
+    X(ALLOC_PAGE) X(FREE_PAGE) X(PAGE_COW) X(FREE_INODE)
+
+#define TRACE_ENUM(name) TRACE_##name,
+enum trace_event { TRACE_EVENTS(TRACE_ENUM) TRACE_NEVENTS };
+#undef TRACE_ENUM
+
+typedef struct trace_rec {
+    uint64_t ns;     // CLOCK_MONOTONIC
+    uint32_t seq;    // position in the trace + 1, 0 while being written
+    uint16_t event;
+    uint16_t _reserved;
+    int32_t  rv;
+    int32_t  arg;    // a size, mode, command or page number
+    int64_t  off;    // an offset, or a second number
+} trace_rec;
+
+// a dump is this header followed by the ring as it was, oldest first
+typedef struct trace_header {
+    uint64_t magic;
+    uint32_t count;  // records that follow
+    uint32_t size;   // sizeof(trace_rec)
+} trace_header;
+
+// a recording is a trace_header with a count of 0, then these, each
+// followed by its paths
+typedef struct record_op {
+    uint64_t ns;     // when the call started, from the start of the recording
+    uint32_t len;    // bytes of paths that follow, each with its NUL
+    uint16_t op;     // enum nufs_op
+    uint16_t npaths; // 2 for link, rename and symlink
+    int32_t  rv;
+    int32_t  arg;    // a size, mode or command
+    int64_t  off;
+    int64_t  off2;   // utimens has its times in off and off2, see record_time
+} record_op;
+
+extern trace_rec* trace_ring;
+extern FILE*      record_file;
+
+int  trace_start(const char* path);
+void trace_stop();
+int  trace_dump();
+void trace_put(int event, int rv, int arg, int64_t off);
+
+int  record_start(const char* path);
+void record_stop();
+void record_flush();
+void record_put(int op, uint64_t start, int rv, const char* path, const char* path2,
+                int arg, int64_t off, int64_t off2);
+int64_t record_time(const struct timespec* ts);
+struct timespec record_timespec(int64_t ns);
+
+// costs a load and a branch while tracing is off
+#define trace(event, rv, arg, off)                       \
+    do {                                                 \
+        if (trace_ring) {                                \
+            trace_put(TRACE_##event, (rv), (arg), (off)); \
+        }                                                \
+    } while (0)
+
+#endif
@@ -0,0 +1,397 @@
+// Implementation of upgrade.h
+//
+// Two kinds of image predate the 128 byte inode: the 1MB ones from
+// before the superblock, and version 1 ones whose superblock has no
+// inode size yet. Both have 48 byte inodes with a 32 bit size and times
+// in seconds. The tables are bigger now, so the upgrade writes a new
+// image next to the old one, with enough extra pages that every data page
+// moves up past the new tables by the same amount, converts the inodes
+// and the snapshots' copies of them, and renames it over the old one,
+// which is kept as <image>.old.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "upgrade.h"
+#include "pages.h"
+#include "inode.h"
+#include "snapshot.h"
+#include "bitmap.h"
+#include "log.h"
+
+typedef struct old_inode {
+    int32_t refs;
+    int32_t mode;
+    int32_t size;
+    int32_t ptrs[nptrs];
+    int32_t iptr;
+    int64_t atim; // seconds
+    int64_t ctim;
+    int64_t mtim;
+} old_inode;
+
+// the superblock of version 1
+typedef struct old_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint32_t inode_count;
+    uint32_t meta_pages;
+    uint64_t page_bitmap;
+    uint64_t inode_bitmap;
+    uint64_t inode_table;
+    uint64_t page_refs;
+    uint64_t snap_table;
+    uint64_t page_fps;
+    uint64_t page_csums;
+    uint64_t scrub_area;
+} old_super;
+
+// Images from before the superblock are 1MB with everything packed into
+// pages 0-3: the bitmaps at the start of page 0, the inode table right
+// after them and the per-page tables stacked down from the end of page 3.
+// Bit 0 of the page bitmap (page 0 itself) is always set on those, and it
+// is clear in NUFS_MAGIC, so the two can't be mistaken for each other.
+static const old_super legacy_super = {
+    .magic        = 0,
+    .version      = 0,
+    .page_size    = 4096,
+    .page_count   = 256,
+    .inode_count  = 256,
+    .meta_pages   = 4,
+    .page_bitmap  = 0,
+    .inode_bitmap = 32,
+    .inode_table  = 64,
+    .page_refs    = 3 * 4096 + 3584,
+    .snap_table   = 3 * 4096 + 3072,
+    .page_fps     = 3 * 4096 + 2048,
+    .page_csums   = 3 * 4096 + 1024,
+    .scrub_area   = 3 * 4096 + 960,
+};
+
+static uint8_t*  old_base = 0;
+static old_super old_sb;
+static int       shift = 0; // how far the data pages move
+
+// the old snapshot slots, laid out as snapshot.c does with 48 byte inodes
+static int
+old_itab_pages() {
+    return (old_sb.inode_count * sizeof(old_inode) + old_sb.page_size - 1) / old_sb.page_size;
+}
+
+static size_t
+old_ctim_offset() {
+    return (sizeof(snapshot) + old_itab_pages() * sizeof(int) + 7) & ~7;
+}
+
+static size_t
+old_slot_size() {
+    return (old_ctim_offset() + sizeof(time_t) + old_sb.inode_count / 8 + 7) & ~7;
+}
+
+static snapshot*
+old_snapshot(int id) {
+    return (snapshot*)(old_base + old_sb.snap_table + id * old_slot_size());
+}
+
+static int
+table_fits(uint64_t off, uint64_t len) {
+    return off + len <= (uint64_t)old_sb.meta_pages * old_sb.page_size;
+}
+
+// works out how an older image is laid out, 1 if it is a current one
+static int
+read_old_super(size_t size) {
+    if (size < sizeof(old_super)) {
+        return -EINVAL;
+    }
+    memcpy(&old_sb, old_base, sizeof(old_sb));
+    if (old_sb.magic == NUFS_MAGIC && old_sb.version >= 2) {
+        return 1;
+    }
+    if (old_sb.magic != NUFS_MAGIC) {
+        if (size != 256 * 4096 || !(old_base[0] & 1)) {
+            return -EINVAL;
+        }
+        old_sb = legacy_super;
+    }
+    else if (old_sb.version != 1) {
+        return -EINVAL;
+    }
+
+    uint64_t ps = old_sb.page_size;
+    uint64_t pc = old_sb.page_count;
+    uint64_t ic = old_sb.inode_count;
+    if (ps < MIN_PAGE_BYTES || ps > MAX_PAGE_BYTES || (ps & (ps - 1)) != 0
+        || pc * ps > size || old_sb.meta_pages >= pc || ic == 0 || ic % 8 != 0
+        || !table_fits(old_sb.page_bitmap, pc / 8)
+        || !table_fits(old_sb.inode_bitmap, ic / 8)
+        || !table_fits(old_sb.inode_table, ic * sizeof(old_inode))
+        || !table_fits(old_sb.page_refs, pc * sizeof(uint16_t))
+        || !table_fits(old_sb.page_fps, pc * sizeof(uint32_t))
+        || !table_fits(old_sb.page_csums, pc * sizeof(uint32_t))
+        || !table_fits(old_sb.snap_table, SNAP_COUNT * old_slot_size())) {
+        return -EINVAL;
+    }
+    for (int id = 0; id < SNAP_COUNT; ++id) {
+        snapshot* snap = old_snapshot(id);
+        for (int ii = 0; snap->used && ii < old_itab_pages(); ++ii) {
+            if (snap->itab[ii] < (int)old_sb.meta_pages || snap->itab[ii] >= (int)pc) {
+                return -EINVAL;
+            }
+        }
+    }
+    return 0;
+}
+
+static int32_t
+shift_ptr(int32_t ptr) {
+    // the pointers after the first ones of a compressed cluster are just PTR_Z
+    return ptr_pnum(ptr) == 0 ? ptr : ptr + shift;
+}
+
+static void
+convert_inode(const old_inode* old, inode* node) {
+    memset(node, 0, sizeof(*node));
+    node->refs = old->refs;
+    node->mode = old->mode;
+    node->size = old->size;
+    node->atim = old->atim * 1000000000LL;
+    node->ctim = old->ctim * 1000000000LL;
+    node->mtim = old->mtim * 1000000000LL;
+    node->gen = 1;
+    node->next_free = -1;
+    for (int ii = 0; ii < nptrs; ++ii) {
+        node->ptrs[ii] = shift_ptr(old->ptrs[ii]);
+    }
+    node->iptr = shift_ptr(old->iptr);
+}
+
+// points an indirect page at where its pages went, once even when shared
+static void
+shift_indirect(int pnum, char* done) {
+    if (pnum <= 0 || bitmap_get(done, pnum)) {
+        return;
+    }
+    bitmap_put(done, pnum, 1);
+    int32_t* ptrs = pages_get_page(pnum);
+    for (int ii = 0; ii < PAGE_BYTES / (int)sizeof(int32_t); ++ii) {
+        ptrs[ii] = shift_ptr(ptrs[ii]);
+    }
+    page_written(pnum);
+}
+
+// the old data pages, snapshot inode tables aside, go shift pages up
+static int
+copy_pages() {
+    char* skip = calloc(old_sb.page_count / 8 + 1, 1);
+    if (skip == NULL) {
+        return -ENOMEM;
+    }
+    for (int id = 0; id < SNAP_COUNT; ++id) {
+        snapshot* snap = old_snapshot(id);
+        for (int ii = 0; snap->used && ii < old_itab_pages(); ++ii) {
+            bitmap_put(skip, snap->itab[ii], 1);
+        }
+    }
+
+    uint8_t*  pbm = old_base + old_sb.page_bitmap;
+    uint16_t* refs = (uint16_t*)(old_base + old_sb.page_refs);
+    uint32_t* fps = (uint32_t*)(old_base + old_sb.page_fps);
+    uint32_t* csums = (uint32_t*)(old_base + old_sb.page_csums);
+    for (int pnum = old_sb.meta_pages; pnum < (int)old_sb.page_count; ++pnum) {
+        if (!bitmap_get(pbm, pnum) || bitmap_get(skip, pnum)) {
+            continue;
+        }
+        int to = pnum + shift;
+        memcpy(pages_get_page(to), old_base + (size_t)pnum * old_sb.page_size, PAGE_BYTES);
+        bitmap_put(get_pages_bitmap(), to, 1);
+        // the first images had neither refcounts nor checksums
+        get_page_refs()[to] = refs[pnum] ? refs[pnum] : 1;
+        get_page_fps()[to] = fps[pnum];
+        get_page_csums()[to] = csums[pnum];
+        if (csums[pnum] == 0) {
+            page_written(to);
+        }
+    }
+    free(skip);
+    return 0;
+}
+
+static void
+copy_inodes(char* done) {
+    old_inode* table = (old_inode*)(old_base + old_sb.inode_table);
+    uint8_t*   ibm = old_base + old_sb.inode_bitmap;
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (bitmap_get(ibm, ii)) {
+            inode* node = get_inode(ii);
+            convert_inode(&table[ii], node);
+            bitmap_put(get_inode_bitmap(), ii, 1);
+            shift_indirect(node->iptr, done);
+        }
+    }
+}
+
+// converts the snapshots' inode tables into new pages
+static int
+copy_snapshots(char* done) {
+    int old_pages = old_itab_pages();
+    int new_pages = snapshot_itab_pages(INODE_COUNT, PAGE_BYTES);
+    uint8_t* old_itab = malloc((size_t)old_pages * PAGE_BYTES);
+    inode*   new_itab = aligned_alloc(64, (size_t)new_pages * PAGE_BYTES);
+    if (old_itab == NULL || new_itab == NULL) {
+        free(old_itab);
+        free(new_itab);
+        return -ENOMEM;
+    }
+    for (int id = 0; id < SNAP_COUNT; ++id) {
+        snapshot* old = old_snapshot(id);
+        if (!old->used) {
+            continue;
+        }
+        for (int ii = 0; ii < old_pages; ++ii) {
+            memcpy(old_itab + (size_t)ii * PAGE_BYTES,
+                   old_base + (size_t)old->itab[ii] * PAGE_BYTES, PAGE_BYTES);
+        }
+        char* ibm = (char*)old + old_ctim_offset() + sizeof(time_t);
+        memset(new_itab, 0, (size_t)new_pages * PAGE_BYTES);
+        for (int ii = 0; ii < INODE_COUNT; ++ii) {
+            if (bitmap_get(ibm, ii)) {
+                convert_inode((old_inode*)old_itab + ii, &new_itab[ii]);
+                shift_indirect(new_itab[ii].iptr, done);
+            }
+        }
+
+        snapshot* snap = get_snapshot(id);
+        snap->used = 1;
+        for (int ii = 0; ii < new_pages; ++ii) {
+            // copy_image left room for these
+            int pnum = alloc_page();
+            memcpy(pages_get_page(pnum), (uint8_t*)new_itab + (size_t)ii * PAGE_BYTES, PAGE_BYTES);
+            page_written(pnum);
+            snap->itab[ii] = pnum;
+        }
+        *snapshot_ctim(snap) = *(time_t*)((char*)old + old_ctim_offset());
+        memcpy(snapshot_bitmap(snap), ibm, INODE_COUNT / 8);
+    }
+    free(old_itab);
+    free(new_itab);
+    return 0;
+}
+
+// formats path big enough for the old image's pages and fills it
+static int
+copy_image(const char* path) {
+    int snaps = 0;
+    for (int id = 0; id < SNAP_COUNT; ++id) {
+        snaps += old_snapshot(id)->used != 0;
+    }
+    int data_pages = old_sb.page_count - old_sb.meta_pages;
+    int page_count = old_sb.page_count;
+    for (;;) {
+        // the tables grow with the page count, so this takes a try or two
+        int rv = pages_format(path, old_sb.page_size, page_count, old_sb.inode_count, 0);
+        if (rv == 0) {
+            rv = pages_open(path, 1);
+        }
+        if (rv < 0) {
+            return rv;
+        }
+        int64_t need = META_PAGES + data_pages
+            + (int64_t)snaps * snapshot_itab_pages(INODE_COUNT, PAGE_BYTES);
+        need = (need + 7) / 8 * 8;
+        if (need <= page_count) {
+            break;
+        }
+        pages_free();
+        if (need >= PTR_Z) {
+            return -EFBIG;
+        }
+        page_count = need;
+    }
+    shift = META_PAGES - old_sb.meta_pages;
+
+    char* done = calloc(PAGE_COUNT / 8 + 1, 1);
+    if (done == NULL) {
+        pages_free();
+        return -ENOMEM;
+    }
+    int rv = copy_pages();
+    if (rv == 0) {
+        copy_inodes(done);
+        rv = copy_snapshots(done);
+    }
+    free(done);
+
+    // opening a version 2 image builds the inode free list
+    get_super()->version = 2;
+    pages_free();
+    if (rv == 0) {
+        rv = pages_open(path, 1);
+        if (rv == 0) {
+            pages_free();
+        }
+    }
+    return rv;
+}
+
+// converts the image at path if an older nufs made it, returns 1 if it
+// did, 0 if the image is current and a negative errno if it isn't one
+int
+upgrade_image(const char* path) {
+    if (strchr(path, ':') != NULL) {
+        // striping came after, so a striped image is a current one
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -EINVAL;
+    }
+    old_base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (old_base == MAP_FAILED) {
+        return -ENOMEM;
+    }
+
+    int rv = read_old_super(st.st_size);
+    if (rv == 1) {
+        munmap(old_base, st.st_size);
+        return 0;
+    }
+    char tmp[PATH_MAX];
+    char old[PATH_MAX];
+    if (rv == 0 && (snprintf(tmp, sizeof(tmp), "%s.new", path) >= (int)sizeof(tmp)
+                    || snprintf(old, sizeof(old), "%s.old", path) >= (int)sizeof(old))) {
+        rv = -ENAMETOOLONG;
+    }
+    if (rv == 0) {
+        rv = copy_image(tmp);
+        if (rv == 0 && (rename(path, old) != 0 || rename(tmp, path) != 0)) {
+            rv = -errno;
+        }
+        if (rv < 0) {
+            unlink(tmp);
+        }
+        else {
+            log_info("+ upgrade_image(%s) -> data moved up %d pages\n", path, shift);
+            rv = 1;
+        }
+    }
+    munmap(old_base, st.st_size);
+    old_base = 0;
+    return rv;
+}
@@ -0,0 +1,8 @@
+// converts images made by an older nufs to the current layout
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+int upgrade_image(const char* path);
+
+#endif
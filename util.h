@@ -29,19 +29,6 @@ clamp(int x, int v0, int v1)
     return max(v0, min(x, v1));
 }
 
-static int
-bytes_to_pages(int bytes)
-{
-    int quo = bytes / 4096;
-    int rem = bytes % 4096;
-    if (rem == 0) {
-        return quo;
-    }
-    else {
-        return quo + 1;
-    }
-}
-
 static void
 join_to_path(char* buf, char* item)
 {